@@ -1,4 +1,5 @@
 #include "Karaoke.h"
+#include "Realtime.h"
 #include <pthread.h>
 #include <semaphore.h>
 #include <iostream>
@@ -7,6 +8,7 @@
 #include <iomanip>
 #include <cstring>
 #include <time.h>
+#include <errno.h>
 
 
 /*
@@ -19,19 +21,6 @@
 
 
 
-enum CDG_INSTRUCTIONS 
-{  
-	MEMORY_PRESET = 1,
-	BORDER_PRESET = 2,
-	TILE_BLOCK_NORMAL = 6,
-	SCROLL_PRESET = 20,
-	SCROLL_COPY = 24,
-	DEF_TRANSPARENT_COLOR = 28,
-	LOAD_COLOR_TABLE_LO = 30,
-	LOAD_COLOR_TABLE_HI = 31,
-	TILE_BLOCK_XOR = 38
-};
-
 
 class MyCDGParser : public CDGParser
 {
@@ -39,16 +28,28 @@ private:
 	CDGReader *cdg_file;
 	unsigned short colors[16];
 	CDGScreenHandler::Screen screen;
+	CDGScreenHandler::TileMap changed;
+	bool any_changed;
 	CDGScreenHandler *handler;
 	KaraokeAudio *ap;
 	pthread_t thread;
 	bool worker_thread_valid;
+	volatile bool stop;
+	unsigned long start_packet;
+	const CDGRealtime *realtime;
+	CDGTimingStats timing;
 
 public:
 	MyCDGParser(CDGScreenHandler *h, KaraokeAudio *player, CDGReader *rdr);
 	~MyCDGParser();	
 	bool Start();
 	bool WaitUntilDone();
+	void Stop();
+	int Decode(const SubCode *s, unsigned long packet = 0);
+	const CDGScreenHandler::Screen *GetScreen() { return &screen; }
+	const unsigned short *GetColors() { return colors; }
+	bool GetChanged(CDGScreenHandler::TileMap &c);
+	bool Restore(const CDGScreenHandler::Screen *s, const unsigned short c[], unsigned long packet);
 	void MemoryPreset(const SubCode *s);
 	void BorderPreset(const SubCode *s);
 	void TileBlockNormal(const SubCode *s);
@@ -58,13 +59,38 @@ public:
 	void LoadColorTableLo(const SubCode *s);
 	void LoadColorTableHi(const SubCode *s);
 	void TileBlockXor(const SubCode *s);
+	void MarkChanged(int row, int col, int rows, int cols);
+	void SetLyricListener(CDGLyricListener *l);
+	void SetRealtime(const CDGRealtime *rt) { realtime = rt; }
+	const CDGTimingStats *GetTimingStats() { return &timing; }
+	void PacedSleep(unsigned long usec);
 	static void *DoParse(void *obj);
+
+private:
+	// Text found on each tile row, a line is a run of rows with text and
+	//  its highlight state is kept on its top row
+	struct LyricRow
+	{
+		unsigned char text[CDGScreenHandler::TILE_COLS];
+		int first_col, last_col;	// -1 when the row has no text
+		unsigned char color;		// color index of the text
+		bool started;
+		int wipe_col;
+	};
+	CDGLyricListener *lyrics;
+	LyricRow lyric_rows[CDGScreenHandler::TILE_ROWS];
+	unsigned short lyric_colors[CDGScreenHandler::MAX_COLORS];
+	void ResetLyrics(int row, int rows);
+	int LineTop(int row);
+	void LyricWipe(int row, int col, unsigned long packet);
+	void TrackTile(const SubCode *s, bool xor_block, unsigned long packet);
+	void TrackPalette(unsigned long packet);
 };
 
 
 MyCDGParser::~MyCDGParser()
 {
-
+	Stop();
 }
 
 bool MyCDGParser::Start()
@@ -75,6 +101,11 @@ bool MyCDGParser::Start()
 	if (!cdg_file->Start())
 		return false;
 
+	// Reader buffers and screens exist by now, locking faults them in
+	if (realtime)
+		realtime->LockMemory();
+	timing.Clear();
+	stop = false;
 	if (pthread_create(&thread, NULL, DoParse, (void *)this))
 		return false;
 
@@ -95,6 +126,15 @@ bool MyCDGParser::WaitUntilDone()
 	return true;
 }
 
+void MyCDGParser::Stop()
+{
+	if (!worker_thread_valid)
+		return;
+	stop = true;
+	cdg_file->Stop();
+	WaitUntilDone();
+}
+
 /*
 ** Returns time difference in Microseconds
 */
@@ -111,96 +151,345 @@ unsigned long time_diff(timespec start, timespec end)
 	return temp.tv_sec * 1000000 + (temp.tv_nsec/1000);
 }
 
+/*
+** Sleeps for usec and records how late the thread got to run again
+*/
+void MyCDGParser::PacedSleep(unsigned long usec)
+{
+	struct timespec wake, now;
+	clock_gettime(CLOCK_MONOTONIC, &wake);
+	wake.tv_sec += usec / 1000000;
+	wake.tv_nsec += (usec % 1000000) * 1000;
+	if (wake.tv_nsec >= 1000000000)
+	{
+		wake.tv_sec++;
+		wake.tv_nsec -= 1000000000;
+	}
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR)
+		;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timing.Wakeup(time_diff(wake, now));
+}
+
 void * MyCDGParser::DoParse(void *ptr)
 { 
 	MyCDGParser *obj = static_cast<MyCDGParser *>(ptr);
 	const SubCode *s;
 	const int USEC_IN_MS = 1000;
-	struct timespec begin, start, end;
-	unsigned long packet_num = 0;
+	struct timespec begin, start;
+	unsigned long packet_num = obj->start_packet;
+	if (obj->realtime)
+	{
+		obj->realtime->Apply("decode");
+		CDGRealtime::PrefaultStack();
+	}
 	if (obj->ap)
-		obj->ap->Play();
-	clock_gettime(CLOCK_REALTIME, &begin);
-	while (!obj->cdg_file->Done())
 	{
+		obj->ap->Play();
 		if (packet_num > 0)
+			obj->ap->SetPlayPosition(CDGPacketToMs(packet_num));
+	}
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	while (!obj->stop && !obj->cdg_file->Done())
+	{
+		if (packet_num > obj->start_packet)
 		{
 			unsigned long diff_time;
 			if (obj->ap)
 				diff_time = USEC_IN_MS * obj->ap->GetPlayPosition();
 			else
 			{
-				clock_gettime(CLOCK_REALTIME, &start);
-				diff_time = time_diff(begin, start);
+				clock_gettime(CLOCK_MONOTONIC, &start);
+				diff_time = time_diff(begin, start) + CDGPacketToUs(obj->start_packet);
 			}
 			// Each CDG packet paces at 1/300th of a second
-			//  which is ~3333 microseconds
-			unsigned long packet_time = packet_num * 3333;
+			unsigned long packet_time = CDGPacketToUs(packet_num);
 			//fprintf(stderr, "%ld - %ld\n", diff_time, packet_time );
-			if (packet_time > diff_time)
-				usleep(packet_time - diff_time);
-
+			if (diff_time > CDGPacketToUs(packet_num + 1))
+				obj->timing.missed++;
+			else if (packet_time > diff_time)
+				obj->PacedSleep(packet_time - diff_time);
 		}
+		obj->timing.packets++;
 		s = obj->cdg_file->ReadNext();
-		if (s == NULL)
-			pthread_exit(NULL);
+		if ((s == NULL) || obj->stop)
+			break;
 		packet_num++;
 
 		//fprintf(stderr, "CMD = %02X\n", s->command);
-		const char *cmd;
-
-		if ((s->command & 0x3F) == 9) 
+		if (obj->Decode(s, packet_num - 1) >= 0)
 		{
-			switch (s->instruction & 0x3F)
+			obj->handler->DisplayChanged(&obj->screen, &obj->changed, CDGPacketToUs(packet_num - 1));
+			if (obj->any_changed)
 			{
-				case MEMORY_PRESET:
-					cmd = "MEMORY_PRESET";
-					obj->MemoryPreset(s);
-					break;
-				case BORDER_PRESET:
-					cmd = "BORDER_PRESET";
-					obj->BorderPreset(s);
-					break;
-				case TILE_BLOCK_NORMAL:
-					cmd = "TILE_BLOCK_NORMAL";
-					obj->TileBlockNormal(s);
-					break;
-				case SCROLL_PRESET:
-					cmd = "SCROLL_PRESET";
-					obj->ScrollPreset(s);
-					break;
-				case SCROLL_COPY:
-					cmd = "SCROLL_COPY";
-					obj->ScrollCopy(s);
-					break;
-				case DEF_TRANSPARENT_COLOR:
-					cmd = "DEF_TRANSPARENT_COLOR";
-					obj->DefTransparentColor(s);
-					break;
-				case LOAD_COLOR_TABLE_LO:
-					cmd = "LOAD_COLOR_TABLE_LO";
-					obj->LoadColorTableLo(s);
-					obj->handler->InitColors(obj->colors);
-					break;
-				case LOAD_COLOR_TABLE_HI:
-					cmd = "LOAD_COLOR_TABLE_HI";
-					obj->LoadColorTableHi(s);
-					obj->handler->InitColors(obj->colors);
-					break;
-				case TILE_BLOCK_XOR:
-					cmd = "TILE_BLOCK_XOR";
-					obj->TileBlockXor(s);
-					break;
-				default:
-					cmd = "Undefined";
+				memset(obj->changed, 0, sizeof(obj->changed));
+				obj->any_changed = false;
 			}
-			obj->handler->Display(&obj->screen);
-			//std::cerr << cmd << "\n";
 		}
 	}
+	unsigned long corrected, dropped;
+	obj->cdg_file->GetParityStats(corrected, dropped);
+	if (corrected || dropped)
+		std::cerr << "Parity: " << corrected << " packets corrected, " << dropped << " dropped\n";
 	pthread_exit(NULL);
 }
 
+int MyCDGParser::Decode(const SubCode *s, unsigned long packet)
+{
+	if ((s == NULL) || ((s->command & 0x3F) != 9))
+		return -1;
+
+	int instruction = s->instruction & 0x3F;
+	if (lyrics && ((instruction == TILE_BLOCK_NORMAL) || (instruction == TILE_BLOCK_XOR)))
+		TrackTile(s, instruction == TILE_BLOCK_XOR, packet);
+	switch (instruction)
+	{
+		case MEMORY_PRESET:
+			MemoryPreset(s);
+			if (lyrics && ((s->data[1] & 0x0F) == 0))
+				ResetLyrics(0, CDGScreenHandler::TILE_ROWS);
+			break;
+		case BORDER_PRESET:
+			BorderPreset(s);
+			break;
+		case TILE_BLOCK_NORMAL:
+			TileBlockNormal(s);
+			break;
+		case SCROLL_PRESET:
+			ScrollPreset(s);
+			break;
+		case SCROLL_COPY:
+			ScrollCopy(s);
+			break;
+		case DEF_TRANSPARENT_COLOR:
+			DefTransparentColor(s);
+			break;
+		case LOAD_COLOR_TABLE_LO:
+			LoadColorTableLo(s);
+			if (handler)
+				handler->InitColors(colors);
+			if (lyrics)
+				TrackPalette(packet);
+			break;
+		case LOAD_COLOR_TABLE_HI:
+			LoadColorTableHi(s);
+			if (handler)
+				handler->InitColors(colors);
+			if (lyrics)
+				TrackPalette(packet);
+			break;
+		case TILE_BLOCK_XOR:
+			TileBlockXor(s);
+			break;
+		default:
+			break;
+	}
+	//std::cerr << CDGInstructionName(instruction) << "\n";
+	return instruction;
+}
+
+const char *CDGInstructionName(int instruction)
+{
+	switch (instruction)
+	{
+		case MEMORY_PRESET:
+			return "MEMORY_PRESET";
+		case BORDER_PRESET:
+			return "BORDER_PRESET";
+		case TILE_BLOCK_NORMAL:
+			return "TILE_BLOCK_NORMAL";
+		case SCROLL_PRESET:
+			return "SCROLL_PRESET";
+		case SCROLL_COPY:
+			return "SCROLL_COPY";
+		case DEF_TRANSPARENT_COLOR:
+			return "DEF_TRANSPARENT_COLOR";
+		case LOAD_COLOR_TABLE_LO:
+			return "LOAD_COLOR_TABLE_LO";
+		case LOAD_COLOR_TABLE_HI:
+			return "LOAD_COLOR_TABLE_HI";
+		case TILE_BLOCK_XOR:
+			return "TILE_BLOCK_XOR";
+		default:
+			return "Undefined";
+	}
+}
+
+/*
+** Lyric lines are found from the way karaoke discs draw them: text is
+**  put on screen with TILE_BLOCK_NORMAL, then highlighted left to right
+**  by TILE_BLOCK_XOR over it, by redrawing its tiles in another color,
+**  or all at once by a palette load changing the color of the text.
+*/
+void MyCDGParser::SetLyricListener(CDGLyricListener *l)
+{
+	lyrics = l;
+	ResetLyrics(0, CDGScreenHandler::TILE_ROWS);
+	memcpy(lyric_colors, colors, sizeof(colors));
+}
+
+void MyCDGParser::ResetLyrics(int row, int rows)
+{
+	for (int r = row; r < row + rows; r++)
+	{
+		memset(lyric_rows[r].text, 0, sizeof(lyric_rows[r].text));
+		lyric_rows[r].first_col = lyric_rows[r].last_col = -1;
+		lyric_rows[r].color = 0;
+		lyric_rows[r].started = false;
+		lyric_rows[r].wipe_col = -1;
+	}
+}
+
+int MyCDGParser::LineTop(int row)
+{
+	while ((row > 0) && (lyric_rows[row - 1].last_col >= 0))
+		row--;
+	return row;
+}
+
+void MyCDGParser::LyricWipe(int row, int col, unsigned long packet)
+{
+	int top = LineTop(row);
+	LyricRow &line = lyric_rows[top];
+	CDGLyricEvent e;
+	e.time = CDGPacketToUs(packet);
+	e.row = top;
+	e.first_col = line.first_col;
+	e.last_col = line.last_col;
+	for (e.rows = 1; (top + e.rows < CDGScreenHandler::TILE_ROWS) && (lyric_rows[top + e.rows].last_col >= 0); e.rows++)
+	{
+		if (lyric_rows[top + e.rows].first_col < e.first_col)
+			e.first_col = lyric_rows[top + e.rows].first_col;
+		if (lyric_rows[top + e.rows].last_col > e.last_col)
+			e.last_col = lyric_rows[top + e.rows].last_col;
+	}
+
+	if (!line.started)
+	{
+		line.started = true;
+		line.wipe_col = -1;
+		e.type = CDGLyricEvent::LINE_START;
+		e.progress = 0;
+		lyrics->LyricEvent(e);
+	}
+	if (col > line.wipe_col)
+	{
+		line.wipe_col = col;
+		if (col > e.last_col)
+			col = e.last_col;
+		e.type = CDGLyricEvent::LINE_PROGRESS;
+		e.progress = (col + 1 - e.first_col) * 1000 / (e.last_col + 1 - e.first_col);
+		if (e.progress < 0)
+			e.progress = 0;
+		lyrics->LyricEvent(e);
+	}
+}
+
+void MyCDGParser::TrackTile(const SubCode *s, bool xor_block, unsigned long packet)
+{
+	int row = s->data[2] & 0x1F;
+	int col = s->data[3] & 0x3F;
+	if ((row >= CDGScreenHandler::TILE_ROWS) || (col >= CDGScreenHandler::TILE_COLS))
+		return;
+	LyricRow &r = lyric_rows[row];
+
+	if (xor_block)
+	{
+		if (r.last_col >= 0)
+			LyricWipe(row, col, packet);
+		return;
+	}
+
+	// Glyphs mix both colors, solid tiles are erasing
+	unsigned char any = 0, all = 0x3F;
+	for (int i = 4; i < 16; i++)
+	{
+		any |= s->data[i] & 0x3F;
+		all &= s->data[i] & 0x3F;
+	}
+	if ((any == 0) || (all == 0x3F) || ((s->data[0] & 0x0F) == (s->data[1] & 0x0F)))
+	{
+		r.text[col] = 0;
+		return;
+	}
+
+	int top = LineTop(row);
+	if (r.text[col] && !lyric_rows[top].started)
+	{
+		// Same glyph redrawn in the highlight color
+		if ((s->data[1] & 0x0F) != r.color)
+			LyricWipe(row, col, packet);
+		return;
+	}
+	if (lyric_rows[top].started && !r.text[col])
+	{
+		// New text where a sung line was
+		int rows = 1;
+		while ((top + rows < CDGScreenHandler::TILE_ROWS) && (lyric_rows[top + rows].last_col >= 0))
+			rows++;
+		ResetLyrics(top, rows);
+	}
+	else if (r.text[col])
+	{
+		if ((s->data[1] & 0x0F) != r.color)
+			LyricWipe(row, col, packet);
+		return;
+	}
+	r.text[col] = 1;
+	r.color = s->data[1] & 0x0F;
+	if ((r.first_col < 0) || (col < r.first_col))
+		r.first_col = col;
+	if (col > r.last_col)
+		r.last_col = col;
+}
+
+void MyCDGParser::TrackPalette(unsigned long packet)
+{
+	for (int row = 0; row < CDGScreenHandler::TILE_ROWS; row++)
+	{
+		LyricRow &r = lyric_rows[row];
+		if ((r.last_col < 0) || (LineTop(row) != row) || r.started)
+			continue;
+		if (lyric_colors[r.color] != colors[r.color])
+			LyricWipe(row, r.last_col, packet);
+	}
+	memcpy(lyric_colors, colors, sizeof(colors));
+}
+
+bool MyCDGParser::GetChanged(CDGScreenHandler::TileMap &c)
+{
+	if (!any_changed)
+		return false;
+	memcpy(c, changed, sizeof(changed));
+	memset(changed, 0, sizeof(changed));
+	any_changed = false;
+	return true;
+}
+
+bool MyCDGParser::Restore(const CDGScreenHandler::Screen *s, const unsigned short c[], unsigned long packet)
+{
+	if (worker_thread_valid)
+		return false;
+	if (s)
+		memcpy(screen, s, sizeof(screen));
+	if (c)
+	{
+		memcpy(colors, c, sizeof(colors));
+		if (handler)
+			handler->InitColors(colors);
+	}
+	start_packet = packet;
+	MarkChanged(0, 0, CDGScreenHandler::TILE_ROWS, CDGScreenHandler::TILE_COLS);
+	return true;
+}
+
+void MyCDGParser::MarkChanged(int row, int col, int rows, int cols)
+{
+	for (int i = row; i < row + rows; i++)
+		memset(&changed[i][col], 1, cols);
+	any_changed = true;
+}
+
 void MyCDGParser::MemoryPreset(const SubCode *s)
 {
 	if (s == NULL)
@@ -211,6 +500,7 @@ void MyCDGParser::MemoryPreset(const SubCode *s)
 		for (int i = 0; i < CDGScreenHandler::HEIGHT; i++)
 			for (int j = 0; j < CDGScreenHandler::WIDTH; j++)
 				screen[i][j] = (s->data[0] & 0x0F);
+		MarkChanged(0, 0, CDGScreenHandler::TILE_ROWS, CDGScreenHandler::TILE_COLS);
 	}
 }
 
@@ -233,6 +523,10 @@ void MyCDGParser::BorderPreset(const SubCode *s)
 			screen[i][j] = col;
 			screen[i][j+294] = col;
 		}
+	MarkChanged(0, 0, 1, CDGScreenHandler::TILE_COLS);
+	MarkChanged(CDGScreenHandler::TILE_ROWS - 1, 0, 1, CDGScreenHandler::TILE_COLS);
+	MarkChanged(0, 0, CDGScreenHandler::TILE_ROWS, 1);
+	MarkChanged(0, CDGScreenHandler::TILE_COLS - 1, CDGScreenHandler::TILE_ROWS, 1);
 }
 
 void MyCDGParser::TileBlockNormal(const SubCode *s)
@@ -243,8 +537,13 @@ void MyCDGParser::TileBlockNormal(const SubCode *s)
 	// Operating on data[16]
 	unsigned char color0 = s->data[0] & 0x0F;
 	unsigned char color1 = s->data[1] & 0x0F;
-	int row = (s->data[2] & 0x1F) * 12;
-	int col = (s->data[3] & 0x3F) * 6;
+	int row = (s->data[2] & 0x1F);
+	int col = (s->data[3] & 0x3F);
+	if ((row >= CDGScreenHandler::TILE_ROWS) || (col >= CDGScreenHandler::TILE_COLS))
+		return;
+	MarkChanged(row, col, 1, 1);
+	row *= 12;
+	col *= 6;
 	int pix_idx = 4;
 
 	for (int i = row; i < row + 12; i++)
@@ -270,8 +569,13 @@ void MyCDGParser::TileBlockXor(const SubCode *s)
 	// Operating on data[16]
 	unsigned char color0 = s->data[0] & 0x0F;
 	unsigned char color1 = s->data[1] & 0x0F;
-	int row = (s->data[2] & 0x1F) * 12;
-	int col = (s->data[3] & 0x3F) * 6;
+	int row = (s->data[2] & 0x1F);
+	int col = (s->data[3] & 0x3F);
+	if ((row >= CDGScreenHandler::TILE_ROWS) || (col >= CDGScreenHandler::TILE_COLS))
+		return;
+	MarkChanged(row, col, 1, 1);
+	row *= 12;
+	col *= 6;
 	int pix_idx = 4;
 
 	for (int i = row; i < row + 12; i++)
@@ -349,11 +653,22 @@ void MyCDGParser::DefTransparentColor(const SubCode *s)
 MyCDGParser::MyCDGParser(CDGScreenHandler *h, KaraokeAudio *player, CDGReader *rdr)
 {
 	worker_thread_valid = false;
+	stop = false;
+	start_packet = 0;
+	lyrics = NULL;
+	realtime = NULL;
 	handler = h;
 	cdg_file = rdr;
+	ap = player;
+	memset(colors, 0, sizeof(colors));
+	memset(screen, 0, sizeof(screen));
+	memset(changed, 0, sizeof(changed));
+	any_changed = false;
+	// Without a handler the parser is only fed through Decode()
+	if (handler == NULL)
+		return;
 	if (cdg_file == NULL)
 		std::cerr << "Cannot open CDG file";
-	ap = player;
 	if (ap == NULL)
 		std::cerr << "Cannot play Audio\n";
 }
@@ -0,0 +1,128 @@
+#include "Karaoke.h"
+#include "Fingerprint.h"
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <time.h>
+
+/*
+** Duplicate song finder
+**  cdgprint add <index> <song.cdg>...    fingerprint songs into the index
+**  cdgprint query <index> <song.cdg>...  list indexed songs matching these
+**  cdgprint dups <index>                 list all groups of duplicates
+*/
+
+static double Now()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static bool Fingerprint(const char *filename, CDGFingerprint::Keyframes &k, unsigned long *packets = NULL)
+{
+	CDGReader *rdr = CDGReader::GetMappedReader(filename);
+	if (rdr == NULL)
+		return false;
+	bool ok = CDGFingerprint::Compute(rdr, k, packets);
+	delete rdr;
+	if (!ok)
+		std::cerr << "Cannot fingerprint " << filename << "\n";
+	return ok;
+}
+
+static int AddSongs(const char *index_name, int count, char *files[])
+{
+	CDGFingerprintIndex index;
+	FILE *f = fopen(index_name, "rb");
+	if (f)
+	{
+		fclose(f);
+		if (!index.Load(index_name))
+			return -1;
+	}
+
+	double begin = Now();
+	unsigned long total_packets = 0;
+	int added = 0;
+	for (int i = 0; i < count; i++)
+	{
+		CDGFingerprint::Keyframes k;
+		unsigned long packets;
+		if (!Fingerprint(files[i], k, &packets))
+			continue;
+		index.Add(files[i], k);
+		total_packets += packets;
+		added++;
+	}
+	double elapsed = Now() - begin;
+	double song_time = (double)total_packets / CDG_PACKETS_PER_SECOND;
+	fprintf(stderr, "%d songs, %.0fs of song in %.2fs (%.0fx real time)\n", added, song_time, elapsed,
+		elapsed > 0 ? song_time / elapsed : 0.0);
+	return index.Save(index_name) ? 0 : -1;
+}
+
+static int QuerySongs(const char *index_name, int count, char *files[])
+{
+	CDGFingerprintIndex index;
+	if (!index.Load(index_name))
+		return -1;
+
+	for (int i = 0; i < count; i++)
+	{
+		CDGFingerprint::Keyframes k;
+		std::vector<CDGFingerprintIndex::Match> matches;
+		if (!Fingerprint(files[i], k))
+			continue;
+		double begin = Now();
+		index.Find(k, matches);
+		double elapsed = Now() - begin;
+		printf("%s (%zu keyframes, %.2fms)\n", files[i], k.size(), elapsed * 1000);
+		for (size_t m = 0; m < matches.size(); m++)
+			printf("\t%.2f %s\n", matches[m].score, index.Name(matches[m].song).c_str());
+	}
+	return 0;
+}
+
+static int ListDuplicates(const char *index_name)
+{
+	CDGFingerprintIndex index;
+	if (!index.Load(index_name))
+		return -1;
+
+	std::vector<bool> reported(index.Size(), false);
+	for (unsigned int i = 0; i < index.Size(); i++)
+	{
+		if (reported[i])
+			continue;
+		std::vector<CDGFingerprintIndex::Match> matches;
+		index.Find(index.Frames(i), matches);
+		bool first = true;
+		for (size_t m = 0; m < matches.size(); m++)
+		{
+			if ((matches[m].song == i) || reported[matches[m].song])
+				continue;
+			if (first)
+				printf("%s\n", index.Name(i).c_str());
+			first = false;
+			reported[matches[m].song] = true;
+			printf("\t%.2f %s\n", matches[m].score, index.Name(matches[m].song).c_str());
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	if ((argc >= 4) && !strcmp(argv[1], "add"))
+		return AddSongs(argv[2], argc - 3, &argv[3]);
+	if ((argc >= 4) && !strcmp(argv[1], "query"))
+		return QuerySongs(argv[2], argc - 3, &argv[3]);
+	if ((argc == 3) && !strcmp(argv[1], "dups"))
+		return ListDuplicates(argv[2]);
+
+	std::cerr << "Usage: " << argv[0] << " add <index> <song.cdg>...\n"
+		<< "       " << argv[0] << " query <index> <song.cdg>...\n"
+		<< "       " << argv[0] << " dups <index>\n";
+	return -1;
+}
@@ -0,0 +1,232 @@
+#include "Karaoke.h"
+#include "SimAudio.h"
+#include "Realtime.h"
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+/*
+** Lyric to audio sync benchmark, needs no sound hardware
+**  Plays a song against the simulated audio clock and, for every frame
+**  that changes the screen, compares the packet time with the position
+**  the listener actually hears at the moment the frame is presented.
+**
+**  cdgsync [-d drift ppm] [-j jitter us] [-g granularity ms]
+**          [-s stalls/minute] [-S stall ms] [-r seed] [-l seconds] [-w]
+**          [-b busy threads] [-P fifo|rr[:priority]] [-A cpu] [-L] file.cdg
+**
+**  -w  pace by the wall clock like a player without audio
+**  -b  competing CPU bound threads, pinned with the decode thread by -A
+**  -P, -A, -L  real-time decode thread, see Realtime.h
+*/
+
+// Stops the song after a number of packets so runs stay short
+class LimitedReader : public CDGReader
+{
+private:
+	CDGReader *rdr;
+	unsigned long left;
+public:
+	LimitedReader(CDGReader *r, unsigned long packets) { rdr = r; left = packets; }
+	~LimitedReader() { delete rdr; }
+	bool Done() { return (left == 0) || rdr->Done(); }
+	bool Start() { return rdr->Start(); }
+	const SubCode *ReadNext()
+	{
+		if (left == 0)
+			return NULL;
+		left--;
+		return rdr->ReadNext();
+	}
+	void GetParityStats(unsigned long &corrected, unsigned long &dropped) { rdr->GetParityStats(corrected, dropped); }
+};
+
+// Background job competing for the CPU
+static volatile bool busy_stop = false;
+static void *Busy(void *arg)
+{
+	const CDGRealtime *rt = static_cast<const CDGRealtime *>(arg);
+	if (rt->cpu >= 0)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(rt->cpu, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+	volatile unsigned long spin = 0;
+	while (!busy_stop)
+		spin++;
+	return NULL;
+}
+
+class SkewRecorder : public CDGScreenHandler
+{
+private:
+	SimulatedAudio *audio;
+	std::vector<long> skew;		// packet time - heard time, microseconds
+public:
+	SkewRecorder(SimulatedAudio *a, size_t expected)
+	{
+		audio = a;
+		// Not grown on the paced path
+		skew.reserve(expected);
+	}
+
+	void InitColors(const unsigned short colors[])
+	{
+	}
+
+	void Display(const Screen *s)
+	{
+	}
+
+	void DisplayChanged(const Screen *s, const TileMap *changed, unsigned long time)
+	{
+		bool any = false;
+		for (int r = 0; (r < TILE_ROWS) && !any; r++)
+			any = (memchr((*changed)[r], 1, TILE_COLS) != NULL);
+		if (any && (skew.size() < skew.capacity()))
+			skew.push_back((long)time - (long)audio->GetTruePosition());
+	}
+
+	void Report()
+	{
+		if (skew.empty())
+		{
+			printf("No frames presented\n");
+			return;
+		}
+		std::vector<long> sorted(skew);
+		std::sort(sorted.begin(), sorted.end());
+		std::vector<long> late(sorted.size());
+		double sum = 0;
+		unsigned long over_packet = 0, over_frame = 0;
+		for (size_t i = 0; i < sorted.size(); i++)
+		{
+			sum += sorted[i];
+			// Packet due at its time, presented when the audio is already past it
+			late[i] = (sorted[i] < 0) ? -sorted[i] : 0;
+			if (late[i] > (long)CDGPacketToUs(1))
+				over_packet++;
+			if (late[i] > 16667)
+				over_frame++;
+		}
+		std::sort(late.begin(), late.end());
+		size_t n = sorted.size();
+
+		printf("frames %zu\n", n);
+		printf("skew us (lyric - audio): min %ld p1 %ld p50 %ld p99 %ld max %ld mean %.0f\n",
+			sorted[0], sorted[n / 100], sorted[n / 2], sorted[n * 99 / 100], sorted[n - 1], sum / n);
+		printf("lateness us: p50 %ld p90 %ld p99 %ld p99.9 %ld max %ld\n",
+			late[n / 2], late[n * 9 / 10], late[n * 99 / 100], late[n * 999 / 1000], late[n - 1]);
+		printf("late by more than a packet %.2f%%, more than a 60Hz frame %.2f%%\n",
+			100.0 * over_packet / n, 100.0 * over_frame / n);
+	}
+};
+
+int main(int argc, char *argv[])
+{
+	SimulatedAudioConfig config;
+	double seconds = 30;
+	bool wall_clock = false;
+	int busy = 0;
+	CDGRealtime rt;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:j:g:s:S:r:l:wb:P:A:L")) != -1)
+	{
+		switch (opt)
+		{
+			case 'd':
+				config.drift_ppm = atof(optarg);
+				break;
+			case 'j':
+				config.jitter_us = atoi(optarg);
+				break;
+			case 'g':
+				config.granularity_ms = atoi(optarg);
+				break;
+			case 's':
+				config.stalls_per_minute = atof(optarg);
+				break;
+			case 'S':
+				config.stall_ms = atoi(optarg);
+				break;
+			case 'r':
+				config.seed = strtoull(optarg, NULL, 10);
+				break;
+			case 'l':
+				seconds = atof(optarg);
+				break;
+			case 'w':
+				wall_clock = true;
+				break;
+			case 'b':
+				busy = atoi(optarg);
+				break;
+			case 'P':
+				if (!rt.SetPolicy(optarg))
+					argc = 0;
+				break;
+			case 'A':
+				rt.cpu = atoi(optarg);
+				break;
+			case 'L':
+				rt.lock_memory = true;
+				break;
+			default:
+				argc = 0;
+		}
+	}
+	if (argc != optind + 1)
+	{
+		std::cerr << "Usage: " << (argc ? argv[0] : "cdgsync") << " [-d drift ppm] [-j jitter us] [-g granularity ms]\n"
+			<< "\t[-s stalls/minute] [-S stall ms] [-r seed] [-l seconds] [-w]\n"
+			<< "\t[-b busy threads] [-P fifo|rr[:priority]] [-A cpu] [-L] file.cdg\n";
+		return -1;
+	}
+
+	unsigned long packets = seconds * CDG_PACKETS_PER_SECOND;
+	SimulatedAudio *audio = SimulatedAudio::GetPlayer(config);
+	CDGReader *rdr = new LimitedReader(CDGReader::GetMappedReader(argv[optind]), packets);
+	SkewRecorder *rec = new SkewRecorder(audio, packets);
+	// Without audio the parser paces by the wall clock, the simulated
+	//  device still plays alongside as the reference
+	CDGParser *parser = CDGParser::GetParser(rec, wall_clock ? NULL : audio, rdr);
+	if (rt.Enabled())
+		parser->SetRealtime(&rt);
+	std::vector<pthread_t> busy_threads(busy);
+	for (int i = 0; i < busy; i++)
+		pthread_create(&busy_threads[i], NULL, Busy, &rt);
+	if (wall_clock)
+		audio->Play();
+	if (!parser->Start())
+	{
+		std::cerr << "Cannot play " << argv[optind] << "\n";
+		return -1;
+	}
+	parser->WaitUntilDone();
+	busy_stop = true;
+	for (int i = 0; i < busy; i++)
+		pthread_join(busy_threads[i], NULL);
+
+	printf("drift %.0fppm jitter %uus granularity %ums stalls %.1f/min x %ums seed %llu%s\n",
+		config.drift_ppm, config.jitter_us, config.granularity_ms, config.stalls_per_minute,
+		config.stall_ms, config.seed, wall_clock ? " (wall clock pacing)" : "");
+	printf("device stalls %lu\n", audio->GetStalls());
+	rec->Report();
+	fflush(stdout);
+	parser->GetTimingStats()->Report("decode thread");
+
+	delete parser;
+	delete rec;
+	delete rdr;
+	delete audio;
+	return 0;
+}
@@ -2,6 +2,7 @@
 #include <cstring>
 #include <time.h>
 #include <cstdio>
+#include <vector>
 #include "fmod.hpp"
 #include "fmod_errors.h"
 
@@ -14,16 +15,31 @@ private:
 	FMOD_RESULT		result;
 	unsigned int	version;
 	void			*extradriverdata ;
-public:
-	FMODAudioPlayer(const char *filename)
+	std::vector<char>	file_data;		// compressed audio of a MEMORY source
+	KaraokeAudioStats	stats;
+	bool			starving;
+	struct timespec	starve_start;
+
+	static unsigned long ElapsedMs(const struct timespec &since)
+	{
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return (now.tv_sec - since.tv_sec) * 1000 + (now.tv_nsec - since.tv_nsec) / 1000000;
+	}
+
+	bool Init()
 	{
 		channel = 0;
+		karaoke = NULL;
+		memset(&stats, 0, sizeof(stats));
+		stats.source = KaraokeAudioConfig::STREAM;
+		starving = false;
 		result = FMOD::System_Create(&fmod_system);
 		if (result != FMOD_OK)
 		{
 			fprintf(stderr, "FMOD did not initialize: (%d) - %s\n", result, FMOD_ErrorString(result));
 			fmod_system = NULL;
-			return;
+			return false;
 		}
 		extradriverdata = NULL;
 		result = fmod_system->init(32, FMOD_INIT_NORMAL, extradriverdata);
@@ -31,15 +47,154 @@ public:
 		{
 			fprintf(stderr, "FMOD System did not initialize: (%d) - %s\n", result, FMOD_ErrorString(result));
 			fmod_system = NULL;
-			return;
+			return false;
 		}
-		result = fmod_system->createStream(filename, FMOD_2D, 0, &karaoke);
+		return true;
+	}
+
+	void CreateStream(const char *name_or_data, FMOD_MODE mode, FMOD_CREATESOUNDEXINFO *info)
+	{
+		result = fmod_system->createStream(name_or_data, mode, info, &karaoke);
 		if (result != FMOD_OK)
 		{
 			fprintf(stderr, "Cannot create audio stream: (%d) - %s\n", result, FMOD_ErrorString(result));
 			fmod_system = NULL;
 			karaoke = NULL;
+		}
+	}
+
+	void CreateSample(const char *filename)
+	{
+		result = fmod_system->createSound(filename, FMOD_2D | FMOD_CREATESAMPLE, 0, &karaoke);
+		if (result != FMOD_OK)
+		{
+			fprintf(stderr, "Cannot decode audio: (%d) - %s\n", result, FMOD_ErrorString(result));
+			fmod_system = NULL;
+			karaoke = NULL;
+			return;
+		}
+		unsigned int bytes = 0;
+		karaoke->getLength(&bytes, FMOD_TIMEUNIT_PCMBYTES);
+		stats.memory_bytes = bytes;
+	}
+
+	// Size of the decoded song from its header, without decoding it
+	bool FitsDecoded(const char *filename, unsigned long cap)
+	{
+		FMOD::Sound *probe;
+		unsigned int bytes = 0;
+		if (fmod_system->createStream(filename, FMOD_2D | FMOD_OPENONLY, 0, &probe) != FMOD_OK)
+			return false;
+		probe->getLength(&bytes, FMOD_TIMEUNIT_PCMBYTES);
+		probe->release();
+		if (cap && (bytes > cap))
+		{
+			fprintf(stderr, "%s decodes to %u bytes, over the %lu byte cap, keeping it compressed\n", filename, bytes, cap);
+			return false;
+		}
+		return true;
+	}
+
+	bool ReadFile(const char *filename)
+	{
+		FILE *f = fopen(filename, "rb");
+		if (f == NULL)
+			return false;
+		bool ok = false;
+		if ((fseek(f, 0, SEEK_END) == 0) && (ftell(f) > 0))
+		{
+			file_data.resize(ftell(f));
+			rewind(f);
+			ok = (fread(&file_data[0], 1, file_data.size(), f) == file_data.size());
+		}
+		fclose(f);
+		if (!ok)
+			file_data.clear();
+		return ok;
+	}
+
+	// Counted on the paced path, so only a flag check when nothing changes
+	void CheckStarving()
+	{
+		FMOD_OPENSTATE state;
+		unsigned int buffered;
+		bool starving_now = false, disk_busy;
+		if (karaoke->getOpenState(&state, &buffered, &starving_now, &disk_busy) != FMOD_OK)
+			return;
+		if (starving_now == starving)
+			return;
+		if (starving_now)
+		{
+			stats.underruns++;
+			clock_gettime(CLOCK_MONOTONIC, &starve_start);
+		}
+		else
+			stats.starved_ms += ElapsedMs(starve_start);
+		starving = starving_now;
+	}
+
+public:
+	FMODAudioPlayer(const char *filename)
+	{
+		if (Init())
+			CreateStream(filename, FMOD_2D, 0);
+	}
+
+	FMODAudioPlayer(const char *filename, const KaraokeAudioConfig &config)
+	{
+		if (!Init())
 			return;
+		if (config.stream_buffer_ms)
+		{
+			result = fmod_system->setStreamBufferSize(config.stream_buffer_ms, FMOD_TIMEUNIT_MS);
+			if (result != FMOD_OK)
+				fprintf(stderr, "Cannot set stream buffer: (%d) - %s\n", result, FMOD_ErrorString(result));
+		}
+
+		struct timespec begin;
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		KaraokeAudioConfig::Source source = config.source;
+		if ((source == KaraokeAudioConfig::DECODED) && !FitsDecoded(filename, config.decoded_cap))
+			source = KaraokeAudioConfig::MEMORY;
+		if ((source == KaraokeAudioConfig::MEMORY) && !ReadFile(filename))
+		{
+			fprintf(stderr, "Cannot read %s into memory, streaming it\n", filename);
+			source = KaraokeAudioConfig::STREAM;
+		}
+		switch (source)
+		{
+			case KaraokeAudioConfig::DECODED:
+				CreateSample(filename);
+				break;
+			case KaraokeAudioConfig::MEMORY:
+			{
+				FMOD_CREATESOUNDEXINFO info;
+				memset(&info, 0, sizeof(info));
+				info.cbsize = sizeof(info);
+				info.length = file_data.size();
+				CreateStream(&file_data[0], FMOD_2D | FMOD_OPENMEMORY_POINT, &info);
+				stats.memory_bytes = file_data.size();
+				break;
+			}
+			default:
+				CreateStream(filename, FMOD_2D, 0);
+		}
+		stats.source = source;
+		stats.open_ms = ElapsedMs(begin);
+	}
+
+	// Decoded from memory owned by the caller, no disk access while playing
+	FMODAudioPlayer(const void *data, unsigned int length)
+	{
+		FMOD_CREATESOUNDEXINFO info;
+		memset(&info, 0, sizeof(info));
+		info.cbsize = sizeof(info);
+		info.length = length;
+		if (Init())
+		{
+			CreateStream((const char *)data, FMOD_2D | FMOD_OPENMEMORY_POINT, &info);
+			stats.source = KaraokeAudioConfig::MEMORY;
+			stats.memory_bytes = length;
 		}
 	}
 
@@ -72,9 +227,11 @@ public:
 
 	unsigned int GetPlayPosition()
 	{
-		unsigned int ret;
+		unsigned int ret = 0;
 		if (channel)
 		{
+			if (stats.source != KaraokeAudioConfig::DECODED)
+				CheckStarving();
 			result = channel->getPosition(&ret, FMOD_TIMEUNIT_MS);
 			if (result != FMOD_OK)
 			{
@@ -90,10 +247,46 @@ public:
 		if (fmod_system)
 			fmod_system->update();
 	}
+
+	bool GetStats(KaraokeAudioStats &st)
+	{
+		if (!fmod_system || !karaoke)
+			return false;
+		float dsp, stream, geometry, update, total;
+		if (fmod_system->getCPUUsage(&dsp, &stream, &geometry, &update, &total) == FMOD_OK)
+			stats.stream_cpu = stream;
+		st = stats;
+		if (starving)
+			st.starved_ms += ElapsedMs(starve_start);
+		return true;
+	}
+
+	bool SetPlayPosition(unsigned int ms)
+	{
+		if (!channel)
+			return false;
+		result = channel->setPosition(ms, FMOD_TIMEUNIT_MS);
+		if (result != FMOD_OK)
+		{
+			fprintf(stderr, "Error in setting play position: (%d) - %s\n", result, FMOD_ErrorString(result));
+			return false;
+		}
+		return true;
+	}
 };
 
 
 KaraokeAudio *KaraokeAudio::GetPlayer(const char *filename)
 {
 	return new FMODAudioPlayer(filename);
+}
+
+KaraokeAudio *KaraokeAudio::GetPlayer(const char *filename, const KaraokeAudioConfig &config)
+{
+	return new FMODAudioPlayer(filename, config);
+}
+
+KaraokeAudio *KaraokeAudio::GetPlayer(const void *data, unsigned int length)
+{
+	return new FMODAudioPlayer(data, length);
 }
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include "Karaoke.h"
+#include "Parity.h"
 #include <pthread.h>
 #include <semaphore.h>
 #include <iostream>
@@ -7,7 +8,18 @@
 #include <sstream>
 #include <iomanip>
 #include <cstring>
+#include <cstdio>
 #include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <errno.h>
+#include <libgen.h>
+#include <signal.h>
+#include <string>
 
 
 
@@ -32,6 +44,7 @@ private:
 	sem_t ready_buffers;
 	sem_t read_next_packet;
 	pthread_mutex_t safety;
+	unsigned long corrected, dropped;
 public:
 	bool Done()
 	{
@@ -48,6 +61,7 @@ public:
 		thread_dead = false;
 		buffers[0] = buffers[1] = NULL;
 		cur_buf = 0;
+		corrected = dropped = 0;
 
 		cdg_file = new std::fstream(filename, std::ios_base::in | std::ios_base::binary);
 		if (cdg_file == NULL)
@@ -159,6 +173,33 @@ public:
 		return NULL;
 	}
 
+	void GetParityStats(unsigned long &c, unsigned long &d)
+	{
+		c = corrected;
+		d = dropped;
+	}
+
+	// Runs on the reader thread, a packet that cannot be repaired is
+	//  blanked so it still takes its place in the pacing
+	void CheckParity(Buffer *b)
+	{
+		for (int i = 0; i < b->ready_count; i++)
+		{
+			switch (CDGParity::Correct(&b->buf[i]))
+			{
+				case CDGParity::CORRECTED:
+					corrected++;
+					break;
+				case CDGParity::UNCORRECTABLE:
+					memset(&b->buf[i], 0, sizeof(SubCode));
+					dropped++;
+					break;
+				default:
+					break;
+			}
+		}
+	}
+
 	static void *ReadCDG(void *ptr)
 	{
 		CDGFileIO *obj = static_cast<CDGFileIO *>(ptr);
@@ -202,6 +243,7 @@ public:
 			if (size % sizeof(SubCode))
 				std::cerr << "CDG file has incomplete packet\n";
 			obj->buffers[cur_buf]->ready_count = size / sizeof(SubCode);
+			obj->CheckParity(obj->buffers[cur_buf]);
 			obj->buffers[cur_buf]->state = READY;
 			cur_buf = (cur_buf + 1) % 2;
 			sem_post(&(obj->ready_buffers));
@@ -210,7 +252,447 @@ public:
 
 };
 
+/*
+** Maps the whole CDG file and hands out packets straight from the mapping.
+**  No reader thread and no copies, meant for headless bulk decoding
+**  (fingerprinting, statistics) where pacing does not matter. Packets
+**  needing repair are copied out first, the mapping is read only.
+*/
+class CDGMappedIO : public CDGReader
+{
+private:
+	const SubCode *packets;
+	size_t packet_count;
+	size_t map_size;
+	size_t read_ptr;
+	bool interleaved;
+	SubCode scratch, empty;
+	unsigned long corrected, dropped;
+public:
+	CDGMappedIO(const char *filename, bool interleaved_packets)
+	{
+		packets = NULL;
+		packet_count = 0;
+		map_size = 0;
+		read_ptr = 0;
+		interleaved = interleaved_packets;
+		memset(&empty, 0, sizeof(empty));
+		corrected = dropped = 0;
+
+		int fd = open(filename, O_RDONLY);
+		if (fd < 0)
+		{
+			std::cerr << "Cannot open CDG file " << filename << "\n";
+			return;
+		}
+		struct stat st;
+		if ((fstat(fd, &st) == 0) && (st.st_size >= (off_t)sizeof(SubCode)))
+		{
+			void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (map != MAP_FAILED)
+			{
+				madvise(map, st.st_size, MADV_SEQUENTIAL);
+				packets = static_cast<const SubCode *>(map);
+				map_size = st.st_size;
+				packet_count = map_size / sizeof(SubCode);
+				if (map_size % sizeof(SubCode))
+					std::cerr << "CDG file has incomplete packet\n";
+			}
+			else
+				std::cerr << "Cannot map CDG file " << filename << "\n";
+		}
+		close(fd);
+	}
+
+	~CDGMappedIO()
+	{
+		if (packets)
+			munmap((void *)packets, map_size);
+	}
+
+	bool Done()
+	{
+		return read_ptr >= packet_count;
+	}
+
+	bool Start()
+	{
+		read_ptr = 0;
+		corrected = dropped = 0;
+		return packets != NULL;
+	}
+
+	const SubCode *ReadNext()
+	{
+		if (read_ptr >= packet_count)
+			return NULL;
+		const SubCode *s = &packets[read_ptr++];
+		if (interleaved)
+		{
+			if (read_ptr + CDGParity::INTERLEAVE_SPAN - 1 > packet_count)
+			{
+				// Tail of the stream is missing its delayed symbols
+				SubCode tail[CDGParity::INTERLEAVE_SPAN];
+				memset(tail, 0, sizeof(tail));
+				memcpy(tail, s, (packet_count - read_ptr + 1) * sizeof(SubCode));
+				CDGParity::Deinterleave(tail, &scratch);
+			}
+			else
+				CDGParity::Deinterleave(s, &scratch);
+			s = &scratch;
+		}
+		if (CDGParity::Valid(s))
+			return s;
+		scratch = *s;
+		if (CDGParity::Correct(&scratch) == CDGParity::CORRECTED)
+		{
+			corrected++;
+			return &scratch;
+		}
+		dropped++;
+		return &empty;
+	}
+
+	void GetParityStats(unsigned long &c, unsigned long &d)
+	{
+		c = corrected;
+		d = dropped;
+	}
+
+	bool Seek(unsigned long packet)
+	{
+		if (packet > packet_count)
+			return false;
+		read_ptr = packet;
+		return true;
+	}
+};
+
+/*
+** Follows a CDG file still being ripped or downloaded. A thread woken by
+**  inotify reads whatever the writer appends, repairs it and stores it
+**  in fixed chunks that never move, so packets handed out stay valid.
+**  ReadNext() keeps a margin behind the writer and waits when playback
+**  catches up with it.
+*/
+class CDGFollowIO : public CDGReader
+{
+private:
+	static const unsigned long CHUNK_PACKETS = 3000;	// 10 seconds
+	static const int MAX_CHUNKS = 4096;
+	static const int STAGING_PACKETS = 300;
+	// Ends a file nothing can be learnt about once it stops growing
+	static const unsigned int UNKNOWN_WRITER_IDLE_MS = 10000;
+	CDGFollowConfig config;
+	std::string marker_dir, marker_name;
+	int fd, notify_fd, stop_fd;
+	SubCode *chunks[MAX_CHUNKS];
+	unsigned long stored;			// reader thread only
+	unsigned long available;		// published under safety
+	bool finished;
+	bool stopped;					// by the consumer, under safety
+	unsigned long read_ptr;
+	unsigned long margin;
+	unsigned char staging[STAGING_PACKETS * sizeof(SubCode)];
+	size_t pending;
+	unsigned long corrected, dropped;
+	bool writer_gone;			// nobody had the file open for writing at Start()
+	pthread_t thread;
+	bool thread_valid;
+	pthread_mutex_t safety;
+	pthread_cond_t grown;
+
+	/*
+	** A read lease is only granted while nobody has the file open for
+	**  writing. It is given back straight away, a writer opening the file
+	**  later is not waited for. Without a lease (a file of another user,
+	**  a network or FUSE file system) the file is followed until it has
+	**  not grown for a while, unless a shorter idle_ms was asked for.
+	*/
+	bool HasWriter()
+	{
+		// A writer opening it meanwhile breaks the lease, SIGURG is ignored
+		fcntl(fd, F_SETSIG, SIGURG);
+		if (fcntl(fd, F_SETLEASE, F_RDLCK) < 0)
+		{
+			if ((errno == EAGAIN) || (errno == EBUSY))
+				return true;
+			if (!config.idle_ms || (config.idle_ms > UNKNOWN_WRITER_IDLE_MS))
+				config.idle_ms = UNKNOWN_WRITER_IDLE_MS;
+			fprintf(stderr, "Cannot tell whether the CDG file is still being written: %s, it ends after %.1fs without growing\n",
+				strerror(errno), config.idle_ms / 1000.0);
+			return true;
+		}
+		fcntl(fd, F_SETLEASE, F_UNLCK);
+		return false;
+	}
+
+	// Reads everything appended so far, false once no more is wanted
+	bool Append()
+	{
+		for (;;)
+		{
+			ssize_t n = read(fd, staging + pending, sizeof(staging) - pending);
+			if (n < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				if (errno == EAGAIN)
+					return true;
+				perror("Cannot read CDG file");
+				return false;
+			}
+			if (n == 0)
+				return true;
+			pending += n;
+			size_t count = pending / sizeof(SubCode);
+			if (!Store(reinterpret_cast<const SubCode *>(staging), count))
+				return false;
+			memmove(staging, staging + count * sizeof(SubCode), pending % sizeof(SubCode));
+			pending %= sizeof(SubCode);
+		}
+	}
+
+	bool Store(const SubCode *packets, size_t count)
+	{
+		bool more = true;
+		for (size_t i = 0; i < count; i++)
+		{
+			if (config.end_packets && (stored >= config.end_packets))
+			{
+				more = false;
+				break;
+			}
+			int c = stored / CHUNK_PACKETS;
+			if (c >= MAX_CHUNKS)
+			{
+				std::cerr << "CDG file too long to follow\n";
+				more = false;
+				break;
+			}
+			if (chunks[c] == NULL)
+				chunks[c] = new SubCode[CHUNK_PACKETS];
+			SubCode *s = &chunks[c][stored % CHUNK_PACKETS];
+			*s = packets[i];
+			switch (CDGParity::Correct(s))
+			{
+				case CDGParity::CORRECTED:
+					corrected++;
+					break;
+				case CDGParity::UNCORRECTABLE:
+					memset(s, 0, sizeof(SubCode));
+					dropped++;
+					break;
+				default:
+					break;
+			}
+			stored++;
+		}
+		if (config.end_packets && (stored >= config.end_packets))
+			more = false;
+		Publish(!more);
+		return more;
+	}
+
+	void Publish(bool done)
+	{
+		pthread_mutex_lock(&safety);
+		available = stored;
+		if (done)
+			finished = true;
+		pthread_cond_broadcast(&grown);
+		pthread_mutex_unlock(&safety);
+	}
+
+	bool MarkerPresent()
+	{
+		return config.end_marker && (access(config.end_marker, F_OK) == 0);
+	}
+
+	static void *Follow(void *ptr)
+	{
+		CDGFollowIO *obj = static_cast<CDGFollowIO *>(ptr);
+		bool more = obj->Append() && !obj->writer_gone && !obj->MarkerPresent();
+		while (more)
+		{
+			struct pollfd fds[2];
+			fds[0].fd = obj->notify_fd;
+			fds[0].events = POLLIN;
+			fds[1].fd = obj->stop_fd;
+			fds[1].events = POLLIN;
+			int n = poll(fds, 2, obj->config.idle_ms ? (int)obj->config.idle_ms : -1);
+			if ((n < 0) && (errno == EINTR))
+				continue;
+			if (n < 0)
+				perror("Cannot wait for CDG file");
+			if ((n <= 0) || (fds[1].revents & POLLIN))
+			{
+				// Writer stalled past idle_ms, or the reader is going away
+				obj->Append();
+				break;
+			}
+
+			bool closed = false;
+			char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+			ssize_t len;
+			while ((len = read(obj->notify_fd, events, sizeof(events))) > 0)
+			{
+				for (char *e = events; e < events + len; )
+				{
+					struct inotify_event *ev = reinterpret_cast<struct inotify_event *>(e);
+					if (ev->mask & (IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF))
+						closed = true;
+					if (ev->len && (obj->marker_name == ev->name))
+						closed = true;
+					e += sizeof(struct inotify_event) + ev->len;
+				}
+			}
+			more = obj->Append() && !closed;
+		}
+		obj->Publish(true);
+		return NULL;
+	}
+
+public:
+	CDGFollowIO(const char *filename, const CDGFollowConfig &c)
+	{
+		config = c;
+		notify_fd = stop_fd = -1;
+		memset(chunks, 0, sizeof(chunks));
+		stored = available = 0;
+		finished = stopped = false;
+		read_ptr = 0;
+		margin = CDGMsToPacket(config.margin_ms);
+		pending = 0;
+		corrected = dropped = 0;
+		writer_gone = false;
+		thread_valid = false;
+		pthread_mutex_init(&safety, NULL);
+		pthread_cond_init(&grown, NULL);
+
+		if ((fd = open(filename, O_RDONLY)) < 0)
+		{
+			std::cerr << "Cannot open CDG file " << filename << "\n";
+			return;
+		}
+		notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if ((notify_fd < 0) || (stop_fd < 0) ||
+			(inotify_add_watch(notify_fd, filename, IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF) < 0))
+		{
+			perror("Cannot watch CDG file");
+			return;
+		}
+		if (config.end_marker)
+		{
+			// Watch the directory the marker will show up in
+			std::string path(config.end_marker);
+			marker_dir = dirname(&path[0]);
+			path = config.end_marker;
+			marker_name = basename(&path[0]);
+			if (inotify_add_watch(notify_fd, marker_dir.c_str(), IN_CREATE | IN_MOVED_TO) < 0)
+				perror("Cannot watch for end marker");
+		}
+	}
+
+	~CDGFollowIO()
+	{
+		if (thread_valid)
+		{
+			uint64_t one = 1;
+			if (write(stop_fd, &one, sizeof(one)) < 0)
+				perror("Cannot stop CDG follower");
+			pthread_join(thread, NULL);
+		}
+		for (int c = 0; c < MAX_CHUNKS; c++)
+			delete[] chunks[c];
+		if (fd >= 0)
+			close(fd);
+		if (notify_fd >= 0)
+			close(notify_fd);
+		if (stop_fd >= 0)
+			close(stop_fd);
+		pthread_cond_destroy(&grown);
+		pthread_mutex_destroy(&safety);
+	}
+
+	bool Done()
+	{
+		pthread_mutex_lock(&safety);
+		bool done = finished && (read_ptr >= available);
+		pthread_mutex_unlock(&safety);
+		return done;
+	}
+
+	bool Start()
+	{
+		if (thread_valid)
+		{
+			read_ptr = 0;
+			return true;
+		}
+		if ((fd < 0) || (notify_fd < 0) || (stop_fd < 0))
+			return false;
+		// Already watched, a writer closing after this is seen by inotify
+		writer_gone = !HasWriter();
+		if (pthread_create(&thread, NULL, Follow, (void *)this))
+		{
+			std::cerr << "CDGFollowIO::Start - Failed thread\n";
+			return false;
+		}
+		thread_valid = true;
+		return true;
+	}
+
+	const SubCode *ReadNext()
+	{
+		pthread_mutex_lock(&safety);
+		while (!finished && !stopped && (read_ptr + margin >= available))
+			pthread_cond_wait(&grown, &safety);
+		bool ready = !stopped && (read_ptr < available);
+		pthread_mutex_unlock(&safety);
+		if (!ready)
+			return NULL;
+		const SubCode *s = &chunks[read_ptr / CHUNK_PACKETS][read_ptr % CHUNK_PACKETS];
+		read_ptr++;
+		return s;
+	}
+
+	void Stop()
+	{
+		pthread_mutex_lock(&safety);
+		stopped = true;
+		pthread_cond_broadcast(&grown);
+		pthread_mutex_unlock(&safety);
+	}
+
+	bool Seek(unsigned long packet)
+	{
+		pthread_mutex_lock(&safety);
+		bool ok = packet <= available;
+		pthread_mutex_unlock(&safety);
+		if (ok)
+			read_ptr = packet;
+		return ok;
+	}
+
+	void GetParityStats(unsigned long &c, unsigned long &d)
+	{
+		c = corrected;
+		d = dropped;
+	}
+};
+
 CDGReader *CDGReader::GetReader(const char *filename)
 {
 	return new CDGFileIO(filename);
-}
\ No newline at end of file
+}
+
+CDGReader *CDGReader::GetMappedReader(const char *filename, bool interleaved)
+{
+	return new CDGMappedIO(filename, interleaved);
+}
+CDGReader *CDGReader::GetFollowingReader(const char *filename, const CDGFollowConfig &config)
+{
+	return new CDGFollowIO(filename, config);
+}
@@ -0,0 +1,310 @@
+#include "Karaoke.h"
+#include "Fingerprint.h"
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+/*
+** Keyframes are taken when drawing on the screen settles (lyric page
+**  written or wiped) and right before the screen is cleared, so they
+**  follow the lyric changes and not the packet clock. Padding or small
+**  time offsets between rips therefore do not change the set of hashes.
+*/
+
+// Half a second without any drawing ends a lyric change
+static const unsigned long QUIET_PACKETS = 150;
+// Keyframes within this many bits are considered the same picture, one
+//  less than the index bands so the index retrieves every such pair
+static const int MAX_DISTANCE = 3;
+
+static unsigned long long Mix(unsigned long long x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+/*
+** SimHash over the tiles inside the border. Every tile holding
+**  foreground is a feature made of its position and its 6x12
+**  foreground bitmap, so close screens give close hashes. Background is
+**  the most used color index so the hash does not depend on the palette.
+*/
+static unsigned long long ScreenHash(const CDGScreenHandler::Screen *scr)
+{
+	const int TW = CDGScreenHandler::CHAR_WIDTH;
+	const int TH = CDGScreenHandler::CHAR_HEIGHT;
+	const int TILE_ROWS = CDGScreenHandler::HEIGHT / TH;
+	const int TILE_COLS = CDGScreenHandler::WIDTH / TW;
+
+	unsigned int hist[CDGScreenHandler::MAX_COLORS] = {0};
+	for (int i = TH; i < (TILE_ROWS - 1) * TH; i += 2)
+		for (int j = TW; j < (TILE_COLS - 1) * TW; j += 2)
+			hist[(*scr)[i][j] & 0x0F]++;
+	unsigned char bg = 0;
+	for (int c = 1; c < CDGScreenHandler::MAX_COLORS; c++)
+		if (hist[c] > hist[bg])
+			bg = c;
+
+	int votes[64] = {0};
+	int features = 0;
+	for (int r = 1; r < TILE_ROWS - 1; r++)
+		for (int c = 1; c < TILE_COLS - 1; c++)
+		{
+			unsigned long long bits = 0;
+			bool fg = false;
+			for (int i = 0; i < TH; i++)
+			{
+				const unsigned char *line = &(*scr)[r * TH + i][c * TW];
+				unsigned int row_bits = 0;
+				for (int j = 0; j < TW; j++)
+					row_bits = (row_bits << 1) | ((line[j] & 0x0F) != bg);
+				fg |= (row_bits != 0);
+				bits = (bits * 0x9E3779B1ULL) ^ row_bits;
+			}
+			if (!fg)
+				continue;
+			unsigned long long h = Mix(bits ^ ((unsigned long long)(r * TILE_COLS + c) << 48));
+			for (int k = 0; k < 64; k++)
+				votes[k] += ((h >> k) & 1) ? 1 : -1;
+			features++;
+		}
+	if (features == 0)
+		return 0;
+
+	unsigned long long hash = 0;
+	for (int k = 0; k < 64; k++)
+		if (votes[k] > 0)
+			hash |= 1ULL << k;
+	return hash;
+}
+
+static void AddKeyframe(CDGParser *p, unsigned long packet, CDGFingerprint::Keyframes &out)
+{
+	unsigned long long hash = ScreenHash(p->GetScreen());
+	if (hash == 0)
+		return;
+	if (!out.empty() && (out.back().hash == hash))
+		return;
+	CDGFingerprint::Keyframe k;
+	k.time_ms = CDGPacketToMs(packet);
+	k.hash = hash;
+	out.push_back(k);
+}
+
+bool CDGFingerprint::Compute(CDGReader *r, Keyframes &out, unsigned long *packets)
+{
+	out.clear();
+	if (packets)
+		*packets = 0;
+	if ((r == NULL) || !r->Start())
+		return false;
+	CDGParser *p = CDGParser::GetParser(NULL, NULL, NULL);
+	if (p == NULL)
+		return false;
+
+	const SubCode *s;
+	unsigned long packet_num = 0, last_draw = 0;
+	bool dirty = false;
+	while ((s = r->ReadNext()) != NULL)
+	{
+		if (dirty && ((s->command & 0x3F) == 9) && ((s->instruction & 0x3F) == MEMORY_PRESET))
+		{
+			AddKeyframe(p, last_draw, out);
+			dirty = false;
+		}
+		switch (p->Decode(s, packet_num))
+		{
+			case TILE_BLOCK_NORMAL:
+			case TILE_BLOCK_XOR:
+			case SCROLL_PRESET:
+			case SCROLL_COPY:
+				dirty = true;
+				last_draw = packet_num;
+				break;
+			default:
+				if (dirty && (packet_num - last_draw >= QUIET_PACKETS))
+				{
+					AddKeyframe(p, last_draw, out);
+					dirty = false;
+				}
+		}
+		packet_num++;
+	}
+	if (dirty)
+		AddKeyframe(p, last_draw, out);
+	delete p;
+	if (packets)
+		*packets = packet_num;
+	return true;
+}
+
+int CDGFingerprint::Distance(unsigned long long a, unsigned long long b)
+{
+	return __builtin_popcountll(a ^ b);
+}
+
+void CDGFingerprintIndex::IndexSong(unsigned int song)
+{
+	const CDGFingerprint::Keyframes &k = songs[song].frames;
+	for (size_t i = 0; i < k.size(); i++)
+		for (int b = 0; b < BANDS; b++)
+		{
+			unsigned int key = (b << 16) | ((k[i].hash >> (16 * b)) & 0xFFFF);
+			std::vector<unsigned int> &list = postings[key];
+			if (list.empty() || (list.back() != song))
+				list.push_back(song);
+		}
+}
+
+unsigned int CDGFingerprintIndex::Add(const std::string &name, const CDGFingerprint::Keyframes &k)
+{
+	Song s;
+	s.name = name;
+	s.frames = k;
+	songs.push_back(s);
+	IndexSong(songs.size() - 1);
+	return songs.size() - 1;
+}
+
+void CDGFingerprintIndex::Find(const CDGFingerprint::Keyframes &k, std::vector<Match> &out, float min_score) const
+{
+	out.clear();
+	if (k.empty())
+		return;
+
+	// Bands shared by a large part of the library (blank lines, title
+	//  layouts) say nothing about a song and would dominate the lookup
+	size_t max_postings = songs.size() / 20 + 64;
+
+	// song -> (last query frame that hit it + 1, frames that hit it)
+	std::unordered_map<unsigned int, std::pair<unsigned int, unsigned int> > hits;
+	for (size_t i = 0; i < k.size(); i++)
+		for (int b = 0; b < BANDS; b++)
+		{
+			unsigned int key = (b << 16) | ((k[i].hash >> (16 * b)) & 0xFFFF);
+			std::unordered_map<unsigned int, std::vector<unsigned int> >::const_iterator it = postings.find(key);
+			if ((it == postings.end()) || (it->second.size() > max_postings))
+				continue;
+			for (size_t j = 0; j < it->second.size(); j++)
+			{
+				std::pair<unsigned int, unsigned int> &h = hits[it->second[j]];
+				if (h.first != i + 1)
+				{
+					h.first = i + 1;
+					h.second++;
+				}
+			}
+		}
+
+	std::unordered_map<unsigned int, std::pair<unsigned int, unsigned int> >::const_iterator h;
+	for (h = hits.begin(); h != hits.end(); ++h)
+	{
+		const CDGFingerprint::Keyframes &c = songs[h->first].frames;
+		size_t longest = std::max(k.size(), c.size());
+		if (h->second.second * 2 < min_score * std::min(k.size(), c.size()))
+			continue;
+
+		unsigned int matched = 0;
+		for (size_t i = 0; i < k.size(); i++)
+			for (size_t j = 0; j < c.size(); j++)
+				if (CDGFingerprint::Distance(k[i].hash, c[j].hash) <= MAX_DISTANCE)
+				{
+					matched++;
+					break;
+				}
+		Match m;
+		m.song = h->first;
+		m.score = (float)matched / longest;
+		if (m.score >= min_score)
+			out.push_back(m);
+	}
+	std::sort(out.begin(), out.end(), [](const Match &a, const Match &b) { return a.score > b.score; });
+}
+
+/*
+** Index file: "CDGF", version, song count and for each song the name
+**  followed by its keyframes. Host byte order.
+*/
+static const char INDEX_MAGIC[4] = { 'C', 'D', 'G', 'F' };
+static const unsigned int INDEX_VERSION = 1;
+
+bool CDGFingerprintIndex::Save(const char *filename) const
+{
+	FILE *f = fopen(filename, "wb");
+	if (f == NULL)
+	{
+		fprintf(stderr, "Cannot write fingerprint index %s\n", filename);
+		return false;
+	}
+	unsigned int count = songs.size();
+	fwrite(INDEX_MAGIC, 1, sizeof(INDEX_MAGIC), f);
+	fwrite(&INDEX_VERSION, sizeof(INDEX_VERSION), 1, f);
+	fwrite(&count, sizeof(count), 1, f);
+	for (size_t i = 0; i < songs.size(); i++)
+	{
+		unsigned int len = songs[i].name.size();
+		unsigned int frames = songs[i].frames.size();
+		fwrite(&len, sizeof(len), 1, f);
+		fwrite(songs[i].name.data(), 1, len, f);
+		fwrite(&frames, sizeof(frames), 1, f);
+		for (size_t j = 0; j < frames; j++)
+		{
+			fwrite(&songs[i].frames[j].time_ms, sizeof(unsigned int), 1, f);
+			fwrite(&songs[i].frames[j].hash, sizeof(unsigned long long), 1, f);
+		}
+	}
+	bool ok = !ferror(f);
+	fclose(f);
+	return ok;
+}
+
+bool CDGFingerprintIndex::Load(const char *filename)
+{
+	FILE *f = fopen(filename, "rb");
+	if (f == NULL)
+		return false;
+
+	char magic[4];
+	unsigned int version, count;
+	if ((fread(magic, 1, sizeof(magic), f) != sizeof(magic)) || memcmp(magic, INDEX_MAGIC, sizeof(magic)) ||
+		(fread(&version, sizeof(version), 1, f) != 1) || (version != INDEX_VERSION) ||
+		(fread(&count, sizeof(count), 1, f) != 1))
+	{
+		fprintf(stderr, "Not a fingerprint index: %s\n", filename);
+		fclose(f);
+		return false;
+	}
+
+	songs.clear();
+	postings.clear();
+	songs.reserve(count);
+	for (unsigned int i = 0; i < count; i++)
+	{
+		unsigned int len, frames;
+		if (fread(&len, sizeof(len), 1, f) != 1)
+			break;
+		std::string name(len, '\0');
+		if ((fread(&name[0], 1, len, f) != len) || (fread(&frames, sizeof(frames), 1, f) != 1))
+			break;
+		CDGFingerprint::Keyframes k(frames);
+		size_t j;
+		for (j = 0; j < frames; j++)
+			if ((fread(&k[j].time_ms, sizeof(unsigned int), 1, f) != 1) ||
+				(fread(&k[j].hash, sizeof(unsigned long long), 1, f) != 1))
+				break;
+		if (j != frames)
+			break;
+		Add(name, k);
+	}
+	fclose(f);
+	if (songs.size() != count)
+	{
+		fprintf(stderr, "Truncated fingerprint index: %s\n", filename);
+		return false;
+	}
+	return true;
+}
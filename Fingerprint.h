@@ -0,0 +1,63 @@
+/*
+** Perceptual fingerprints of CD+G songs for duplicate detection
+**
+**  A song is fingerprinted by decoding it headless and hashing the screen
+**  each time a burst of lyric drawing settles. The hash only looks at
+**  background vs. foreground so the same song from a different vendor
+**  (other palette, other padding) produces the same set of hashes.
+**
+** (c) Niranjan Nagar
+*/
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+class CDGReader;
+
+class CDGFingerprint
+{
+public:
+	struct Keyframe
+	{
+		unsigned int time_ms;
+		unsigned long long hash;
+	};
+	typedef std::vector<Keyframe> Keyframes;
+
+	// Decodes the whole reader (unpaced) and collects keyframe hashes,
+	//  packets gets the length of the song
+	static bool Compute(CDGReader *r, Keyframes &out, unsigned long *packets = NULL);
+	static int Distance(unsigned long long a, unsigned long long b);
+};
+
+class CDGFingerprintIndex
+{
+public:
+	struct Match
+	{
+		unsigned int song;
+		float score;
+	};
+
+	unsigned int Add(const std::string &name, const CDGFingerprint::Keyframes &k);
+	// Songs sharing at least min_score of their keyframes with k, best first
+	void Find(const CDGFingerprint::Keyframes &k, std::vector<Match> &out, float min_score = 0.5f) const;
+	unsigned int Size() const { return songs.size(); }
+	const std::string &Name(unsigned int song) const { return songs[song].name; }
+	const CDGFingerprint::Keyframes &Frames(unsigned int song) const { return songs[song].frames; }
+	bool Save(const char *filename) const;
+	bool Load(const char *filename);
+
+private:
+	struct Song
+	{
+		std::string name;
+		CDGFingerprint::Keyframes frames;
+	};
+	std::vector<Song> songs;
+	// 64 bit hashes are split in 4 bands of 16 bits, two hashes at most
+	//  3 bits apart are bound to share at least one band
+	static const int BANDS = 4;
+	std::unordered_map<unsigned int, std::vector<unsigned int> > postings;
+	void IndexSong(unsigned int song);
+};
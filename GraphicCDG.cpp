@@ -1,12 +1,19 @@
 #include "Karaoke.h"
+#include "SongCache.h"
+#include "Realtime.h"
 #include <GLFW/glfw3.h>
 #include <iostream>
 #include <cstring>
 #include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <unistd.h>
 
 GLushort *screen_buffer;
 GLuint k_tex;
 int cur_height = CDGScreenHandler::HEIGHT, cur_width = CDGScreenHandler::WIDTH;
+int tex_height = CDGScreenHandler::HEIGHT, tex_width = CDGScreenHandler::WIDTH;
 
 void *RefreshScreen(GLFWwindow *win)
 {
@@ -15,15 +22,15 @@ void *RefreshScreen(GLFWwindow *win)
   	glLoadIdentity();
   	glOrtho(0.0f, cur_width, 0.0f, cur_height, 0.0f, 1.0f);
 	glEnable(GL_TEXTURE_RECTANGLE);
-	glTexImage2D(GL_TEXTURE_RECTANGLE, 0, GL_RGBA4, CDGScreenHandler::WIDTH, CDGScreenHandler::HEIGHT, 0, GL_RGBA, GL_UNSIGNED_SHORT_4_4_4_4, screen_buffer);
+	glTexImage2D(GL_TEXTURE_RECTANGLE, 0, GL_RGBA4, tex_width, tex_height, 0, GL_RGBA, GL_UNSIGNED_SHORT_4_4_4_4, screen_buffer);
 	glBegin(GL_QUADS);
 	glTexCoord2f(0, 0);
 	glVertex2f(0,0);
-	glTexCoord2f(CDGScreenHandler::WIDTH, 0);
+	glTexCoord2f(tex_width, 0);
 	glVertex2f(cur_width, 0);
-	glTexCoord2f(CDGScreenHandler::WIDTH,CDGScreenHandler::HEIGHT);
+	glTexCoord2f(tex_width, tex_height);
 	glVertex2f(cur_width, cur_height);
-	glTexCoord2f(0, CDGScreenHandler::HEIGHT);
+	glTexCoord2f(0, tex_height);
 	glVertex2f(0, cur_height);
 	glEnd();
 	glFlush();
@@ -49,7 +56,7 @@ void ResizeScreen(GLFWwindow *window, int width, int height)
   	glMatrixMode(GL_MODELVIEW);
 }
 
-class GraphicsDisplay : public CDGScreenHandler
+class GraphicsDisplay : public CDGScreenHandler, public CDGMosaicHandler
 {
 private:
 	char *song_path;
@@ -57,20 +64,23 @@ private:
 	unsigned short screen_colors[MAX_COLORS];
 
 public:
-	GraphicsDisplay(char *filename)
+	// A mosaic of several screens needs a bigger texture
+	GraphicsDisplay(char *filename, int width = WIDTH, int height = HEIGHT)
 	{
 		window = NULL;
 		screen_buffer = NULL;
+		tex_width = cur_width = width;
+		tex_height = cur_height = height;
 		if (!glfwInit())
 			return;
-		if ((window = glfwCreateWindow(WIDTH, HEIGHT, filename, NULL, NULL)) == NULL)
+		if ((window = glfwCreateWindow(width, height, filename, NULL, NULL)) == NULL)
 			return;
 		glfwSetWindowRefreshCallback(window, (GLFWwindowrefreshfun)RefreshScreen);
 		glfwSetWindowSizeCallback(window, (GLFWwindowsizefun)ResizeScreen);
-		screen_buffer = new GLushort[HEIGHT * WIDTH];
+		screen_buffer = new GLushort[height * width];
 		if (screen_buffer == NULL)
 			return;
-		memset(screen_buffer, 0, sizeof(GLushort) * HEIGHT * WIDTH);
+		memset(screen_buffer, 0, sizeof(GLushort) * height * width);
 		glfwMakeContextCurrent(window);
 
 		glDepthMask(false);
@@ -107,6 +117,15 @@ public:
 		glfwPostEmptyEvent();
 	}
 
+	void DisplayMosaic(const unsigned short *pixels, int width, int height)
+	{
+		if (!screen_buffer || (width != tex_width) || (height != tex_height))
+			return;
+		for (int i = 0; i < height; i++)
+			memcpy(&screen_buffer[(height - i - 1) * width], &pixels[i * width], sizeof(GLushort) * width);
+		glfwPostEmptyEvent();
+	}
+
 	void MainLoop()
 	{		
 		if (!window)
@@ -118,64 +137,283 @@ public:
 		}
 	}
 
+	// Shows frames published by another player until it goes away
+	void MainLoop(CDGScreenSubscriber *sub)
+	{
+		if (!window)
+			return;
+		while (!glfwWindowShouldClose(window) && sub->Poll(this))
+		{
+			glfwWaitEventsTimeout(1.0 / 60);
+			RefreshScreen(window);
+		}
+	}
+
 };
 
-int main(int argc, char *argv[])	
+// Song preview wall, all songs muted in one window
+static int Mosaic(int columns, int count, char *bases[])
 {
-
-	if (argc == 2)
+	CDGMultiplexer *mux;
+	int rows = (count + columns - 1) / columns;
+	int cols = (count < columns) ? count : columns;
+	GraphicsDisplay *gd = new GraphicsDisplay((char *)"Preview", cols * CDGScreenHandler::WIDTH, rows * CDGScreenHandler::HEIGHT);
+	if ((mux = CDGMultiplexer::GetMultiplexer(gd, columns, 30)) == NULL)
 	{
-		char *cdg_name = new char[strlen(argv[1]) + 4];
-		char *mp3_name = new char[strlen(argv[1]) + 4];
-		CDGParser *c;
+		std::cerr << "Cannot create multiplexer\n";
+		delete gd;
+		return -1;
+	}
 
+	std::vector<CDGReader *> readers;
+	for (int i = 0; i < count; i++)
+	{
+		std::string cdg_name = std::string(bases[i]) + ".cdg";
+		CDGReader *rdr = CDGReader::GetMappedReader(cdg_name.c_str());
+		if (!mux->Add(rdr))
+		{
+			std::cerr << "Cannot play " << cdg_name << "\n";
+			delete rdr;
+			continue;
+		}
+		readers.push_back(rdr);
+	}
 
+	mux->Start();
+	gd->MainLoop();
+	// Closing the window ends the songs still playing
+	mux->Stop();
 
-		sprintf(cdg_name, "%s.cdg", argv[1]);
-		sprintf(mp3_name, "%s.mp3", argv[1]);
+	delete mux;
+	for (size_t i = 0; i < readers.size(); i++)
+		delete readers[i];
+	delete gd;
+	return 0;
+}
 
-		CDGReader *rdr = CDGReader::GetReader(cdg_name);
-		if (rdr == NULL)
-		{
-			std::cerr << "Cannot create File Reader\n";
-			return -1;			
-		}
+static int Subscribe(const char *name)
+{
+	CDGScreenSubscriber *sub = CDGScreenSubscriber::GetSubscriber(name);
+	if (sub == NULL)
+	{
+		std::cerr << "Cannot create subscriber\n";
+		return -1;
+	}
+	GraphicsDisplay *gd = new GraphicsDisplay((char *)name);
+	gd->MainLoop(sub);
+	delete gd;
+	delete sub;
+	return 0;
+}
 
-		KaraokeAudio *player = KaraokeAudio::GetPlayer(mp3_name);
-		if (player == NULL)
-		{
-			std::cerr << "Cannot create FMOD Audio\n";
-			delete rdr;
-			return -1;						
-		}
-		GraphicsDisplay *gd = new GraphicsDisplay(argv[1]);
-		if (gd == NULL)
-		{
-			std::cerr << "Cannot create GraphicsDisplay\n";
-			delete rdr;
-			delete player;
-			return -1;
-		}
+static int Play(char *base, const char *publish, CDGSongCache *cache, unsigned int start_ms,
+	const CDGRealtime &rt, bool report_timing, const CDGFollowConfig *follow, const KaraokeAudioConfig &audio)
+{
+	CDGSongCache::SongPtr song;
+	CDGReader *rdr;
+	KaraokeAudio *player;
 
-		CDGParser *parser = CDGParser::GetParser(gd, player, rdr);
-		if (parser == NULL)
-		{
-			delete gd;
-			delete player;
-			delete rdr;
-			std::cerr << "Cannot create CDG Parser\n";
+	if (cache)
+	{
+		if (!(song = cache->Get(base)))
 			return -1;
-		}
-
-		parser->Start();
-		gd->MainLoop();
+		rdr = CDGSongCache::GetReader(song);
+		player = CDGSongCache::GetPlayer(song);
+	}
+	else
+	{
+		char *cdg_name = new char[strlen(base) + 5];
+		char *mp3_name = new char[strlen(base) + 5];
+		sprintf(cdg_name, "%s.cdg", base);
+		sprintf(mp3_name, "%s.mp3", base);
+		// A song still being ripped is played as it grows
+		if (follow)
+			rdr = CDGReader::GetFollowingReader(cdg_name, *follow);
+		else
+			rdr = CDGReader::GetReader(cdg_name);
+		player = KaraokeAudio::GetPlayer(mp3_name, audio);
+		delete[] cdg_name;
+		delete[] mp3_name;
+	}
 
-		delete parser;
+	if (rdr == NULL)
+	{
+		std::cerr << "Cannot create File Reader\n";
 		delete player;
+		return -1;			
+	}
+	if (player == NULL)
+	{
+		std::cerr << "Cannot create FMOD Audio\n";
 		delete rdr;
+		return -1;						
+	}
+	GraphicsDisplay *gd = new GraphicsDisplay(base);
+	if (gd == NULL)
+	{
+		std::cerr << "Cannot create GraphicsDisplay\n";
+		delete rdr;
+		delete player;
+		return -1;
+	}
+	CDGScreenHandler *screen = gd;
+	if (publish)
+		screen = CDGScreenHandler::GetPublisher(publish, gd);
+
+	CDGParser *parser = CDGParser::GetParser(screen, player, rdr);
+	if (parser == NULL)
+	{
 		delete gd;
+		delete player;
+		delete rdr;
+		std::cerr << "Cannot create CDG Parser\n";
+		return -1;
 	}
-	else
-		std::cerr << "Usage: " << argv[0]  << " <base file>\n";
+	if (start_ms && !(cache && CDGSongCache::Seek(song, parser, rdr, start_ms)))
+		std::cerr << "Cannot start " << base << " at " << start_ms << "ms\n";
+
+	if (rt.Enabled())
+	{
+		parser->SetRealtime(&rt);
+		rt.Apply("present", -1);
+	}
+	parser->Start();
+	gd->MainLoop();
+	// The window may have been closed before the song ended, nothing
+	//  below can go while the decode thread still uses it
+	parser->Stop();
+	// Counted so far, the song may have been cut short
+	if (report_timing)
+	{
+		static const char *sources[] = { "stream", "memory", "decoded" };
+		KaraokeAudioStats st;
+		parser->GetTimingStats()->Report(base);
+		if (player->GetStats(st))
+			fprintf(stderr, "audio %s: opened in %ums, %lu bytes in memory, %lu underruns for %lums, streaming %.1f%% CPU\n",
+				sources[st.source], st.open_ms, st.memory_bytes, st.underruns, st.starved_ms, st.stream_cpu);
+	}
+
+	delete parser;
+	delete player;
+	delete rdr;
+	if (screen != gd)
+		delete screen;
+	delete gd;
+	return 0;
+}
+
+int main(int argc, char *argv[])	
+{
+	const char *publish = NULL;
+	int mosaic = 0;
+	unsigned long cache_mb = 0;
+	unsigned int start_ms = 0;
+	CDGRealtime rt;
+	bool report_timing = false;
+	CDGFollowConfig follow;
+	bool following = false;
+	KaraokeAudioConfig audio;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "p:s:g:c:t:P:A:LJfe:i:a:B:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'p':
+				publish = optarg;
+				break;
+			case 'g':
+				mosaic = atoi(optarg);
+				break;
+			case 'c':
+				cache_mb = strtoul(optarg, NULL, 10);
+				break;
+			case 't':
+				start_ms = atof(optarg) * 1000;
+				break;
+			case 'P':
+				if (!rt.SetPolicy(optarg))
+				{
+					std::cerr << "Unknown scheduling policy " << optarg << "\n";
+					return -1;
+				}
+				break;
+			case 'A':
+				rt.cpu = atoi(optarg);
+				break;
+			case 'L':
+				rt.lock_memory = true;
+				break;
+			case 'J':
+				report_timing = true;
+				break;
+			case 'e':
+				follow.end_marker = optarg;
+				following = true;
+				break;
+			case 'f':
+				following = true;
+				break;
+			case 'i':
+				follow.idle_ms = atof(optarg) * 1000;
+				following = true;
+				break;
+			case 'a':
+			{
+				const char *colon = strchr(optarg, ':');
+				size_t len = colon ? (size_t)(colon - optarg) : strlen(optarg);
+				if (!strncmp(optarg, "stream", len))
+					audio.source = KaraokeAudioConfig::STREAM;
+				else if (!strncmp(optarg, "memory", len))
+					audio.source = KaraokeAudioConfig::MEMORY;
+				else if (!strncmp(optarg, "decoded", len))
+					audio.source = KaraokeAudioConfig::DECODED;
+				else
+				{
+					std::cerr << "Unknown audio source " << optarg << "\n";
+					return -1;
+				}
+				if (colon)
+					audio.decoded_cap = strtoul(colon + 1, NULL, 10) << 20;
+				break;
+			}
+			case 'B':
+				audio.stream_buffer_ms = atoi(optarg);
+				break;
+			case 's':
+				return Subscribe(optarg);
+			default:
+				argc = 0;
+		}
+	}
+
+	if ((mosaic > 0) && (argc > optind))
+		return Mosaic(mosaic, argc - optind, &argv[optind]);
+	if ((argc == optind + 1) && !cache_mb)
+		return Play(argv[optind], publish, NULL, start_ms, rt, report_timing, following ? &follow : NULL, audio);
+	if ((argc > optind) && cache_mb)
+	{
+		// Songs are played in turn, closing the window moves to the next,
+		//  a song asked for again comes from memory
+		CDGSongCache cache(cache_mb << 20);
+		for (int i = optind; i < argc; i++)
+			Play(argv[i], publish, &cache, start_ms, rt, report_timing, NULL, audio);
+		unsigned long hits, misses, evictions;
+		size_t bytes;
+		cache.Stats(hits, misses, evictions, bytes);
+		fprintf(stderr, "Song cache: %lu hits, %lu misses, %lu evictions, %zu bytes\n", hits, misses, evictions, bytes);
+		return 0;
+	}
+
+	std::cerr << "Usage: " << argv[0]  << " [-p <shared name>] [-t <seconds>] [-f] [-e <end marker>] [-i <seconds>] <base file>\n"
+		<< "       " << argv[0] << " -c <cache MB> [-p <shared name>] [-t <seconds>] <base file>...\n"
+		<< "       " << argv[0] << " -s <shared name>\n"
+		<< "       " << argv[0] << " -g <columns> <base file>...\n"
+		<< "Real-time playback: -P fifo|rr[:priority] -A <cpu> -L (lock memory), -J reports timing\n"
+		<< "Songs still being written: -f follows the file until the writer closes it,\n"
+		<< "  -e also ends it when the marker file appears, -i after the writer has\n"
+		<< "  stalled this many seconds\n"
+		<< "Audio: -a stream|memory|decoded[:cap MB] plays from the file, from the file\n"
+		<< "  in memory or decoded in memory, -B <ms> sets the stream buffer\n";
 	return 0;
-}
\ No newline at end of file
+}
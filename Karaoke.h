@@ -7,6 +7,20 @@
 ** (c) Niranjan Nagar
 **  uses CD+G spec from http://jbum.com/cdg_revealed.html
 */
+enum CDG_INSTRUCTIONS
+{
+	MEMORY_PRESET = 1,
+	BORDER_PRESET = 2,
+	TILE_BLOCK_NORMAL = 6,
+	SCROLL_PRESET = 20,
+	SCROLL_COPY = 24,
+	DEF_TRANSPARENT_COLOR = 28,
+	LOAD_COLOR_TABLE_LO = 30,
+	LOAD_COLOR_TABLE_HI = 31,
+	TILE_BLOCK_XOR = 38
+};
+const char *CDGInstructionName(int instruction);
+
 struct SubCode
 {
 	unsigned char command;
@@ -16,6 +30,12 @@ struct SubCode
 	unsigned char parityP[4];
 };
 
+// Packets are played at 300 per second, times are from the song start
+const unsigned long CDG_PACKETS_PER_SECOND = 300;
+inline unsigned long CDGPacketToMs(unsigned long packet) { return packet * 1000 / CDG_PACKETS_PER_SECOND; }
+inline unsigned long CDGPacketToUs(unsigned long packet) { return packet * 1000000 / CDG_PACKETS_PER_SECOND; }
+inline unsigned long CDGMsToPacket(unsigned long ms) { return ms * CDG_PACKETS_PER_SECOND / 1000; }
+
 class CDGScreenHandler
 {
 public:
@@ -27,34 +47,182 @@ public:
 	static const int RED_MASK = 0x0F00;
 	static const int GREEN_MASK = 0x00F0;
 	static const int BLUE_MASK = 0x000F;
+	static const int TILE_ROWS = HEIGHT / CHAR_HEIGHT;
+	static const int TILE_COLS = WIDTH / CHAR_WIDTH;
 	typedef unsigned char Screen[HEIGHT][WIDTH];
+	typedef unsigned char TileMap[TILE_ROWS][TILE_COLS];
+	virtual ~CDGScreenHandler() {}
 	virtual void InitColors(const unsigned short colors[]) = 0;
 	virtual void Display(const Screen *Hs) = 0;
+	// Called by the parser instead of Display() with the tiles changed since
+	//  the previous call and the song position in microseconds
+	virtual void DisplayChanged(const Screen *s, const TileMap *changed, unsigned long time) { Display(s); }
+	// Publishes every frame in shared memory, then hands it to local (if any)
+	static CDGScreenHandler *GetPublisher(const char *name, CDGScreenHandler *local);
+};
+
+struct CDGLyricEvent
+{
+	enum Type { LINE_START, LINE_PROGRESS };
+	Type type;
+	unsigned long time;			// song position in microseconds
+	int row, rows;				// tile rows covered by the line
+	int first_col, last_col;	// tile columns covered by its text
+	int progress;				// highlight wipe position, 0 - 1000
+};
+
+class CDGLyricListener
+{
+public:
+	virtual ~CDGLyricListener() {}
+	virtual void LyricEvent(const CDGLyricEvent &e) = 0;
+};
+
+class CDGScreenSubscriber
+{
+public:
+	virtual ~CDGScreenSubscriber() {}
+	// Shows the latest published frame on h if it is newer than the last
+	//  one shown, returns false once the publisher has gone away
+	virtual bool Poll(CDGScreenHandler *h) = 0;
+	static CDGScreenSubscriber *GetSubscriber(const char *name);
+};
+
+// Where the audio of a song is played from
+struct KaraokeAudioConfig
+{
+	enum Source
+	{
+		STREAM,		// read and decoded from the file while playing
+		MEMORY,		// whole file read first, decoded while playing
+		DECODED		// decoded to PCM before playing
+	};
+	Source source;
+	unsigned long decoded_cap;		// bytes of PCM, above it DECODED falls back to MEMORY
+	unsigned int stream_buffer_ms;	// file buffer of streamed sources, 0 for the default
+
+	KaraokeAudioConfig()
+	{
+		source = STREAM;
+		decoded_cap = 256UL << 20;
+		stream_buffer_ms = 0;
+	}
+};
+
+struct KaraokeAudioStats
+{
+	KaraokeAudioConfig::Source source;	// actually used
+	unsigned int open_ms;			// reading and decoding before playback could start
+	unsigned long memory_bytes;		// audio held in memory
+	unsigned long underruns;		// times the decoder starved while playing
+	unsigned long starved_ms;
+	float stream_cpu;				// percent of a CPU spent streaming and decoding, now
 };
 
 class KaraokeAudio
 {
 public:
+	virtual ~KaraokeAudio() {}
 	virtual bool Play() = 0;
 	virtual unsigned int GetPlayPosition() = 0;
 	virtual void Update() = 0;
+	virtual bool SetPlayPosition(unsigned int ms) { return false; }
+	virtual bool GetStats(KaraokeAudioStats &stats) { return false; }
 	static KaraokeAudio *GetPlayer(const char *filename);
+	static KaraokeAudio *GetPlayer(const char *filename, const KaraokeAudioConfig &config);
+	// Encoded audio already in memory, data must outlive the player
+	static KaraokeAudio *GetPlayer(const void *data, unsigned int length);
+};
+
+// When a song still being written is complete, the writer closing the
+//  file always ends it
+struct CDGFollowConfig
+{
+	unsigned long end_packets;	// known length of the song, 0 if unknown
+	const char *end_marker;		// file whose appearance ends the song, or NULL
+	unsigned int margin_ms;		// playback stays this far behind the writer
+	unsigned int idle_ms;		// writer quiet this long ends the song, 0 never
+
+	CDGFollowConfig()
+	{
+		end_packets = 0;
+		end_marker = 0;
+		margin_ms = 500;
+		idle_ms = 0;
+	}
 };
 
 class CDGReader
 {
 public:
+	virtual ~CDGReader() {}
 	virtual bool Done() = 0;
 	virtual bool Start() = 0;
 	virtual const SubCode *ReadNext() = 0;
+	// Next ReadNext() returns this packet, not all readers can seek
+	virtual bool Seek(unsigned long packet) { return false; }
+	// Wakes a ReadNext() waiting for packets not written yet, playback is
+	//  ending early
+	virtual void Stop() {}
+	// Packets repaired from their P/Q parity and packets dropped (read
+	//  back as empty) because they could not be
+	virtual void GetParityStats(unsigned long &corrected, unsigned long &dropped) { corrected = dropped = 0; }
 	static CDGReader *GetReader(const char *filename);
+	// interleaved is for raw subchannel dumps, .cdg files are not
+	static CDGReader *GetMappedReader(const char *filename, bool interleaved = false);
+	// Keeps reading what is appended to the file until config says it is done
+	static CDGReader *GetFollowingReader(const char *filename, const CDGFollowConfig &config);
 };
 
+class CDGRealtime;
+struct CDGTimingStats;
+
 class CDGParser
 {
 public:
+	virtual ~CDGParser() {}
 	virtual bool Start() = 0;
 	virtual bool WaitUntilDone() = 0;
+	// Ends playback before the song does, returns once the decode thread
+	//  has and nothing it was given is used any more
+	virtual void Stop() = 0;
+	// Headless decode of a single packet, no pacing and no Display()
+	//  returns the CDG instruction or -1 if not a CD+G packet. packet
+	//  is the position in the song, only used to time lyric events
+	virtual int Decode(const SubCode *s, unsigned long packet = 0) = 0;
+	virtual const CDGScreenHandler::Screen *GetScreen() = 0;
+	virtual const unsigned short *GetColors() = 0;
+	// Tiles changed by Decode() since the last call, returns false if none
+	virtual bool GetChanged(CDGScreenHandler::TileMap &changed) = 0;
+	// Before Start(), resumes from a snapshot (NULL keeps the current
+	//  screen or colors) with packet as the first one to be played
+	virtual bool Restore(const CDGScreenHandler::Screen *s, const unsigned short colors[], unsigned long packet) = 0;
+	// Lyric lines and their highlight are reported while decoding
+	virtual void SetLyricListener(CDGLyricListener *l) = 0;
+	// Before Start(), runs the decode thread under rt (see Realtime.h)
+	virtual void SetRealtime(const CDGRealtime *rt) = 0;
+	// Wakeup lateness and missed deadlines of the paced decode
+	virtual const CDGTimingStats *GetTimingStats() = 0;
 	static CDGParser *GetParser(CDGScreenHandler *h, KaraokeAudio *p, CDGReader *r);
 };
 
+class CDGMosaicHandler
+{
+public:
+	virtual ~CDGMosaicHandler() {}
+	// All streams of a multiplexer in one frame, RGBA 4:4:4:4 top row first
+	virtual void DisplayMosaic(const unsigned short *pixels, int width, int height) = 0;
+};
+
+class CDGMultiplexer
+{
+public:
+	virtual ~CDGMultiplexer() {}
+	// Streams are added before Start(), each is laid out in the next cell
+	virtual bool Add(CDGReader *r) = 0;
+	virtual bool Start() = 0;
+	virtual bool WaitUntilDone() = 0;
+	// Ends every stream where it is, returns once the timer thread has
+	virtual void Stop() = 0;
+	static CDGMultiplexer *GetMultiplexer(CDGMosaicHandler *h, int columns, int fps);
+};
@@ -0,0 +1,277 @@
+#include "Karaoke.h"
+#include <pthread.h>
+#include <iostream>
+#include <cstring>
+#include <vector>
+#include <queue>
+#include <time.h>
+
+/*
+** Plays many songs muted on one thread
+**  Every stream is a headless parser fed from its reader. A single timer
+**  thread keeps the streams in a heap ordered by the time of their next
+**  graphics packet, sleeps until the earliest one is due and decodes
+**  whatever every stream has due by then. At each refresh the tiles that
+**  changed are converted into one mosaic frame handed over in one call.
+*/
+
+// Deadlines this close together are served by the same wakeup
+static const unsigned long SLACK_USEC = 2000;
+
+class MyCDGMultiplexer : public CDGMultiplexer
+{
+private:
+	struct Stream
+	{
+		CDGReader *rdr;
+		CDGParser *parser;
+		const SubCode *next;		// read but not due yet
+		unsigned long packet;		// index of next
+		unsigned short colors[CDGScreenHandler::MAX_COLORS];
+		int x, y;
+		bool done;
+	};
+	// Heap entry, stream == -1 is the mosaic refresh
+	struct Deadline
+	{
+		unsigned long time;
+		int stream;
+		bool operator>(const Deadline &o) const { return time > o.time; }
+	};
+
+	std::vector<Stream> streams;
+	std::priority_queue<Deadline, std::vector<Deadline>, std::greater<Deadline> > heap;
+	CDGMosaicHandler *handler;
+	int columns;
+	unsigned long refresh_usec;
+	int width, height;
+	std::vector<unsigned short> mosaic;
+	pthread_t thread;
+	bool worker_thread_valid;
+	// Wakes the timer thread early when the mosaic is closed
+	bool stop;
+	pthread_mutex_t safety;
+	pthread_cond_t stopped;
+
+	// Sleeps until the deadline, false if stopped meanwhile
+	bool SleepUntil(const timespec &wake)
+	{
+		int err = 0;
+		pthread_mutex_lock(&safety);
+		while (!stop && !err)
+			err = pthread_cond_timedwait(&stopped, &safety, &wake);
+		bool running = !stop;
+		pthread_mutex_unlock(&safety);
+		return running;
+	}
+
+	// Skips packets that draw nothing, false at the end of the stream
+	bool ReadAhead(Stream &st)
+	{
+		while ((st.next = st.rdr->ReadNext()) != NULL)
+		{
+			if ((st.next->command & 0x3F) == 9)
+				return true;
+			st.packet++;
+		}
+		st.done = true;
+		return false;
+	}
+
+	// Decodes every packet of a stream due up to now, returns its next deadline
+	bool Advance(Stream &st, unsigned long now, unsigned long &deadline)
+	{
+		while (!st.done && (CDGPacketToUs(st.packet) <= now))
+		{
+			st.parser->Decode(st.next, st.packet);
+			st.packet++;
+			ReadAhead(st);
+		}
+		deadline = CDGPacketToUs(st.packet);
+		return !st.done;
+	}
+
+	void Compose(Stream &st)
+	{
+		CDGScreenHandler::TileMap changed;
+		const unsigned short *colors = st.parser->GetColors();
+		bool all = memcmp(st.colors, colors, sizeof(st.colors)) != 0;
+		if (!st.parser->GetChanged(changed) && !all)
+			return;
+		unsigned short rgba[CDGScreenHandler::MAX_COLORS];
+		for (int i = 0; i < CDGScreenHandler::MAX_COLORS; i++)
+			rgba[i] = (colors[i] << 4) | 0x000F;
+		memcpy(st.colors, colors, sizeof(st.colors));
+
+		const CDGScreenHandler::Screen &s = *st.parser->GetScreen();
+		for (int r = 0; r < CDGScreenHandler::TILE_ROWS; r++)
+			for (int c = 0; c < CDGScreenHandler::TILE_COLS; c++)
+			{
+				if (!all && !changed[r][c])
+					continue;
+				for (int i = r * CDGScreenHandler::CHAR_HEIGHT; i < (r + 1) * CDGScreenHandler::CHAR_HEIGHT; i++)
+				{
+					unsigned short *dst = &mosaic[(st.y + i) * width + st.x + c * CDGScreenHandler::CHAR_WIDTH];
+					const unsigned char *src = &s[i][c * CDGScreenHandler::CHAR_WIDTH];
+					for (int j = 0; j < CDGScreenHandler::CHAR_WIDTH; j++)
+						dst[j] = rgba[src[j]];
+				}
+			}
+	}
+
+	static unsigned long Elapsed(const timespec &begin)
+	{
+		timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return (now.tv_sec - begin.tv_sec) * 1000000 + (now.tv_nsec - begin.tv_nsec) / 1000;
+	}
+
+	static void *DoMultiplex(void *ptr)
+	{
+		MyCDGMultiplexer *obj = static_cast<MyCDGMultiplexer *>(ptr);
+		timespec begin;
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		int running = obj->streams.size();
+
+		Deadline refresh = { 0, -1 };
+		obj->heap.push(refresh);
+		for (size_t i = 0; i < obj->streams.size(); i++)
+		{
+			Deadline d = { 0, (int)i };
+			if (obj->ReadAhead(obj->streams[i]))
+				obj->heap.push(d);
+			else
+				running--;
+		}
+
+		while (!obj->heap.empty())
+		{
+			Deadline d = obj->heap.top();
+			unsigned long now = Elapsed(begin);
+			if (d.time > now)
+			{
+				timespec wake = begin;
+				wake.tv_sec += d.time / 1000000;
+				wake.tv_nsec += (d.time % 1000000) * 1000;
+				if (wake.tv_nsec >= 1000000000)
+				{
+					wake.tv_sec++;
+					wake.tv_nsec -= 1000000000;
+				}
+				if (!obj->SleepUntil(wake))
+					break;
+				now = Elapsed(begin);
+			}
+
+			while (!obj->heap.empty() && (obj->heap.top().time <= now + SLACK_USEC))
+			{
+				d = obj->heap.top();
+				obj->heap.pop();
+				if (d.stream < 0)
+				{
+					for (size_t i = 0; i < obj->streams.size(); i++)
+						obj->Compose(obj->streams[i]);
+					obj->handler->DisplayMosaic(&obj->mosaic[0], obj->width, obj->height);
+					if (running == 0)
+						continue;
+					d.time += obj->refresh_usec;
+					if (d.time < now)
+						d.time = now + obj->refresh_usec;
+					obj->heap.push(d);
+				}
+				else if (obj->Advance(obj->streams[d.stream], now + SLACK_USEC, d.time))
+					obj->heap.push(d);
+				else
+					running--;
+			}
+		}
+		pthread_exit(NULL);
+	}
+
+public:
+	MyCDGMultiplexer(CDGMosaicHandler *h, int cols, int fps)
+	{
+		handler = h;
+		columns = (cols > 0) ? cols : 1;
+		refresh_usec = 1000000 / ((fps > 0) ? fps : 30);
+		width = height = 0;
+		worker_thread_valid = false;
+		stop = false;
+		pthread_mutex_init(&safety, NULL);
+		// Deadlines are on the monotonic clock
+		pthread_condattr_t attr;
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&stopped, &attr);
+		pthread_condattr_destroy(&attr);
+	}
+
+	~MyCDGMultiplexer()
+	{
+		WaitUntilDone();
+		for (size_t i = 0; i < streams.size(); i++)
+			delete streams[i].parser;
+		pthread_cond_destroy(&stopped);
+		pthread_mutex_destroy(&safety);
+	}
+
+	bool Add(CDGReader *r)
+	{
+		if ((r == NULL) || worker_thread_valid || !r->Start())
+			return false;
+		Stream st;
+		st.rdr = r;
+		st.parser = CDGParser::GetParser(NULL, NULL, NULL);
+		if (st.parser == NULL)
+			return false;
+		st.next = NULL;
+		st.packet = 0;
+		st.done = false;
+		// Differs from any real palette so the first refresh draws everything
+		memset(st.colors, 0xFF, sizeof(st.colors));
+		st.x = (streams.size() % columns) * CDGScreenHandler::WIDTH;
+		st.y = (streams.size() / columns) * CDGScreenHandler::HEIGHT;
+		streams.push_back(st);
+		return true;
+	}
+
+	bool Start()
+	{
+		if ((handler == NULL) || streams.empty() || worker_thread_valid)
+			return false;
+		int rows = (streams.size() + columns - 1) / columns;
+		width = ((int)streams.size() < columns ? streams.size() : columns) * CDGScreenHandler::WIDTH;
+		height = rows * CDGScreenHandler::HEIGHT;
+		mosaic.assign(width * height, 0x000F);
+
+		if (pthread_create(&thread, NULL, DoMultiplex, (void *)this))
+			return false;
+		worker_thread_valid = true;
+		return true;
+	}
+
+	bool WaitUntilDone()
+	{
+		void *status;
+		if (worker_thread_valid)
+		{
+			pthread_join(thread, &status);
+			worker_thread_valid = false;
+		}
+		return true;
+	}
+
+	void Stop()
+	{
+		pthread_mutex_lock(&safety);
+		stop = true;
+		pthread_cond_signal(&stopped);
+		pthread_mutex_unlock(&safety);
+		WaitUntilDone();
+	}
+};
+
+CDGMultiplexer *CDGMultiplexer::GetMultiplexer(CDGMosaicHandler *h, int columns, int fps)
+{
+	return new MyCDGMultiplexer(h, columns, fps);
+}
@@ -0,0 +1,195 @@
+#include "Karaoke.h"
+#include "Parity.h"
+#include <cstring>
+#include <stdint.h>
+
+// GF(2^6) generated by x^6 + x + 1
+static const int GF_POLY = 0x43;
+static const int GF_ORDER = 63;
+
+static const int P_SYMBOLS = 24;
+static const int Q_SYMBOLS = 4;
+
+static struct ParityTables
+{
+	unsigned char exp[2 * GF_ORDER];
+	int log[64];
+	// Syndromes S0..S3 of value v at position j, one per byte
+	uint32_t p[P_SYMBOLS][64];
+	// Syndromes S0, S1 of the Q code
+	uint16_t q[Q_SYMBOLS][64];
+
+	ParityTables()
+	{
+		int x = 1;
+		for (int i = 0; i < GF_ORDER; i++)
+		{
+			exp[i] = exp[i + GF_ORDER] = x;
+			log[x] = i;
+			x <<= 1;
+			if (x & 0x40)
+				x ^= GF_POLY;
+		}
+		log[0] = -1;
+
+		// Position j is weighted by alpha^(k * (n - 1 - j)) in syndrome k
+		for (int j = 0; j < P_SYMBOLS; j++)
+			for (int v = 0; v < 64; v++)
+			{
+				uint32_t syn = 0;
+				for (int k = 0; k < 4; k++)
+					syn |= (uint32_t)Mul(v, exp[(k * (P_SYMBOLS - 1 - j)) % GF_ORDER]) << (8 * k);
+				p[j][v] = syn;
+			}
+		for (int j = 0; j < Q_SYMBOLS; j++)
+			for (int v = 0; v < 64; v++)
+				q[j][v] = v | (Mul(v, exp[Q_SYMBOLS - 1 - j]) << 8);
+	}
+
+	int Mul(int a, int b) const
+	{
+		if ((a == 0) || (b == 0))
+			return 0;
+		return exp[log[a] + log[b]];
+	}
+
+	int Div(int a, int b) const
+	{
+		if (a == 0)
+			return 0;
+		return exp[log[a] - log[b] + GF_ORDER];
+	}
+} gf;
+
+static inline uint32_t PSyndromes(const unsigned char *b)
+{
+	uint32_t syn = 0;
+	for (int j = 0; j < P_SYMBOLS; j++)
+		syn ^= gf.p[j][b[j] & 0x3F];
+	return syn;
+}
+
+static inline uint16_t QSyndromes(const unsigned char *b)
+{
+	return gf.q[0][b[0] & 0x3F] ^ gf.q[1][b[1] & 0x3F] ^ gf.q[2][b[2] & 0x3F] ^ gf.q[3][b[3] & 0x3F];
+}
+
+static inline bool Unprotected(const unsigned char *b)
+{
+	return ((b[2] | b[3] | b[20] | b[21] | b[22] | b[23]) & 0x3F) == 0;
+}
+
+// One bad symbol among the first four
+static bool CorrectQ(unsigned char *b, uint16_t syn)
+{
+	int s0 = syn & 0xFF, s1 = syn >> 8;
+	if ((s0 == 0) || (s1 == 0))
+		return false;
+	int j = Q_SYMBOLS - 1 - gf.log[gf.Div(s1, s0)];
+	if (j < 0)
+		return false;
+	b[j] ^= s0;
+	return true;
+}
+
+// Up to two bad symbols, Peterson's direct solution for the locator
+static bool CorrectP(unsigned char *b, uint32_t syn)
+{
+	int s0 = syn & 0xFF, s1 = (syn >> 8) & 0xFF, s2 = (syn >> 16) & 0xFF, s3 = syn >> 24;
+	int det = gf.Mul(s1, s1) ^ gf.Mul(s0, s2);
+	if (det == 0)
+	{
+		if ((s0 == 0) || (s1 == 0))
+			return false;
+		int x = gf.Div(s1, s0);
+		int j = P_SYMBOLS - 1 - gf.log[x];
+		if ((j < 0) || (gf.Mul(s1, x) != s2) || (gf.Mul(s2, x) != s3))
+			return false;
+		b[j] ^= s0;
+		return true;
+	}
+
+	int l1 = gf.Div(gf.Mul(s1, s2) ^ gf.Mul(s0, s3), det);
+	int l2 = gf.Div(gf.Mul(s1, s3) ^ gf.Mul(s2, s2), det);
+	int found = 0, pos[2], loc[2];
+	for (int j = 0; j < P_SYMBOLS; j++)
+	{
+		int power = P_SYMBOLS - 1 - j;
+		int inv = gf.exp[(GF_ORDER - power) % GF_ORDER];
+		if ((1 ^ gf.Mul(l1, inv) ^ gf.Mul(l2, gf.Mul(inv, inv))) != 0)
+			continue;
+		if (found == 2)
+			return false;
+		pos[found] = j;
+		loc[found++] = gf.exp[power];
+	}
+	if (found != 2)
+		return false;
+	int e0 = gf.Div(s1 ^ gf.Mul(s0, loc[1]), loc[0] ^ loc[1]);
+	b[pos[0]] ^= e0;
+	b[pos[1]] ^= s0 ^ e0;
+	return true;
+}
+
+bool CDGParity::Valid(const SubCode *s)
+{
+	const unsigned char *b = reinterpret_cast<const unsigned char *>(s);
+	return Unprotected(b) || ((PSyndromes(b) == 0) && (QSyndromes(b) == 0));
+}
+
+CDGParity::Result CDGParity::Correct(SubCode *s)
+{
+	unsigned char *b = reinterpret_cast<unsigned char *>(s);
+	if (Unprotected(b))
+		return UNPROTECTED;
+	uint32_t p = PSyndromes(b);
+	uint16_t q = QSyndromes(b);
+	if ((p == 0) && (q == 0))
+		return CLEAN;
+
+	// Q first, it is the stronger code for the command and instruction
+	unsigned char fixed[P_SYMBOLS];
+	for (int j = 0; j < P_SYMBOLS; j++)
+		fixed[j] = b[j] & 0x3F;
+	if (q)
+	{
+		CorrectQ(fixed, q);
+		p = PSyndromes(fixed);
+	}
+	if (p)
+		CorrectP(fixed, p);
+	// A miscorrection leaves non zero syndromes behind. Q miscorrects
+	//  two bad symbols among the first four, P alone can still fix them
+	if (PSyndromes(fixed) || QSyndromes(fixed))
+	{
+		for (int j = 0; j < P_SYMBOLS; j++)
+			fixed[j] = b[j] & 0x3F;
+		p = PSyndromes(fixed);
+		if (!p || !CorrectP(fixed, p) || PSyndromes(fixed) || QSyndromes(fixed))
+			return UNCORRECTABLE;
+	}
+
+	// P and Q channel bits are not covered
+	for (int j = 0; j < P_SYMBOLS; j++)
+		b[j] = (b[j] & 0xC0) | fixed[j];
+	return CORRECTED;
+}
+
+/*
+** On the disc symbols 1 and 18, 2 and 5, 3 and 23 trade places and
+**  every symbol is then delayed by its position modulo 8 packets
+*/
+void CDGParity::Deinterleave(const SubCode *raw, SubCode *out)
+{
+	static const int swap[P_SYMBOLS] = {
+		0, 18, 5, 23, 4, 2, 6, 7, 8, 9, 10, 11,
+		12, 13, 14, 15, 16, 17, 1, 19, 20, 21, 22, 3
+	};
+	const unsigned char *in = reinterpret_cast<const unsigned char *>(raw);
+	unsigned char *b = reinterpret_cast<unsigned char *>(out);
+	for (int j = 0; j < P_SYMBOLS; j++)
+	{
+		int k = swap[j];
+		b[j] = in[(k % INTERLEAVE_SPAN) * sizeof(SubCode) + k];
+	}
+}
@@ -0,0 +1,30 @@
+/*
+** Reed-Solomon check and repair of subcode packets
+**  Every packet carries two codes over GF(2^6): Q, an RS(4,2) over the
+**  command and instruction, and P, an RS(24,20) over the whole packet,
+**  correcting one and two bad symbols. Syndromes come from tables that
+**  hold the contribution of each symbol value at each position, all
+**  four P syndromes packed in one word, so a clean packet costs 28
+**  lookups.
+**
+**  Packets are checked in the order they have once the disc interleave
+**  is undone, which is how .cdg files store them. Raw subchannel dumps
+**  still interleaved go through Deinterleave() first.
+**
+** (c) Niranjan Nagar
+*/
+
+class CDGParity
+{
+public:
+	enum Result { CLEAN, UNPROTECTED, CORRECTED, UNCORRECTABLE };
+
+	// Clean packets and packets without parity (most rips zero it)
+	static bool Valid(const SubCode *s);
+	// Repairs the packet in place, it is left alone if UNCORRECTABLE
+	static Result Correct(SubCode *s);
+	// Packet n of a stream still interleaved, raw points at packet n and
+	//  the 7 packets following it must be readable
+	static void Deinterleave(const SubCode *raw, SubCode *out);
+	static const int INTERLEAVE_SPAN = 8;
+};
@@ -0,0 +1,124 @@
+#include "Realtime.h"
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+static const size_t PREFAULT_STACK = 64 * 1024;
+
+const unsigned long CDGTimingStats::bounds[CDGTimingStats::BUCKETS - 1] = {
+	50, 100, 250, 500, 1000, 2000, 3333, 10000
+};
+
+CDGRealtime::CDGRealtime()
+{
+	policy = NORMAL;
+	priority = 0;
+	cpu = -1;
+	lock_memory = false;
+}
+
+bool CDGRealtime::SetPolicy(const char *spec)
+{
+	const char *colon = strchr(spec, ':');
+	size_t len = colon ? (size_t)(colon - spec) : strlen(spec);
+	if ((len == 4) && !strncmp(spec, "fifo", len))
+		policy = FIFO;
+	else if ((len == 2) && !strncmp(spec, "rr", len))
+		policy = RR;
+	else if ((len == 6) && !strncmp(spec, "normal", len))
+		policy = NORMAL;
+	else
+		return false;
+	priority = colon ? atoi(colon + 1) : 0;
+	if ((priority == 0) && (policy != NORMAL))
+	{
+		// Above the usual threaded interrupt handlers
+		priority = 60;
+	}
+	return true;
+}
+
+bool CDGRealtime::Apply(const char *who, int priority_offset) const
+{
+	bool ok = true;
+	if (cpu >= 0)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (err)
+		{
+			std::cerr << "Cannot pin " << who << " thread to CPU " << cpu << ": " << strerror(err) << "\n";
+			ok = false;
+		}
+	}
+	if (policy != NORMAL)
+	{
+		int sched = (policy == FIFO) ? SCHED_FIFO : SCHED_RR;
+		struct sched_param param;
+		param.sched_priority = priority + priority_offset;
+		if (param.sched_priority < sched_get_priority_min(sched))
+			param.sched_priority = sched_get_priority_min(sched);
+		if (param.sched_priority > sched_get_priority_max(sched))
+			param.sched_priority = sched_get_priority_max(sched);
+		int err = pthread_setschedparam(pthread_self(), sched, &param);
+		if (err)
+		{
+			std::cerr << "Cannot make " << who << " thread real-time: " << strerror(err)
+				<< ", running at normal priority\n";
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+bool CDGRealtime::LockMemory() const
+{
+	static bool locked = false;
+	if (!lock_memory || locked)
+		return true;
+	// Also faults in every page mapped so far
+	if (mlockall(MCL_CURRENT | MCL_FUTURE))
+	{
+		perror("Cannot lock memory, pages may be faulted in during playback");
+		return false;
+	}
+	locked = true;
+	return true;
+}
+
+void CDGRealtime::PrefaultStack()
+{
+	volatile char stack[PREFAULT_STACK];
+	for (size_t i = 0; i < sizeof(stack); i += 4096)
+		stack[i] = 0;
+}
+
+void CDGTimingStats::Clear()
+{
+	packets = missed = wakeups = 0;
+	memset(histogram, 0, sizeof(histogram));
+	max_late = 0;
+	total_late = 0;
+}
+
+void CDGTimingStats::Report(const char *title) const
+{
+	fprintf(stderr, "%s: %lu packets, %lu missed deadlines (%.3f%%)\n", title, packets, missed,
+		packets ? 100.0 * missed / packets : 0.0);
+	fprintf(stderr, "wakeups %lu, late by mean %.0fus max %luus\n", wakeups,
+		wakeups ? (double)total_late / wakeups : 0.0, max_late);
+	for (int b = 0; b < BUCKETS; b++)
+	{
+		if (b < BUCKETS - 1)
+			fprintf(stderr, "\t< %5luus", bounds[b]);
+		else
+			fprintf(stderr, "\t>=%5luus", bounds[b - 1]);
+		fprintf(stderr, " %10lu %6.2f%%\n", histogram[b], wakeups ? 100.0 * histogram[b] / wakeups : 0.0);
+	}
+}
@@ -0,0 +1,62 @@
+/*
+** Real-time playback for busy machines
+**  Runs the decode and present threads under a real-time scheduling
+**  policy, optionally pinned to a CPU with all memory locked. Anything
+**  not permitted is reported once and playback carries on at normal
+**  priority.
+**
+**  CDGTimingStats records how late the decode thread wakes up for its
+**  packets and how many packets it decodes a whole packet period late.
+**
+** (c) Niranjan Nagar
+*/
+
+class CDGRealtime
+{
+public:
+	enum Policy { NORMAL, FIFO, RR };
+	Policy policy;
+	int priority;		// of the decode thread, the present thread runs one below
+	int cpu;			// -1 for any
+	bool lock_memory;
+
+	CDGRealtime();
+	// "fifo", "rr" or "normal", with an optional ":priority"
+	bool SetPolicy(const char *spec);
+	bool Enabled() const { return (policy != NORMAL) || (cpu >= 0) || lock_memory; }
+	// Applies to the calling thread, priority relative to the configured one
+	bool Apply(const char *who, int priority_offset = 0) const;
+	// mlockall() of everything mapped now and later, once per process
+	bool LockMemory() const;
+	// Touches the calling thread's stack so the paced path never faults it in
+	static void PrefaultStack();
+};
+
+struct CDGTimingStats
+{
+	static const int BUCKETS = 9;
+	// Upper bounds of the wakeup lateness buckets in microseconds
+	static const unsigned long bounds[BUCKETS - 1];
+	unsigned long packets;
+	unsigned long missed;		// decoded more than a packet period after due
+	unsigned long wakeups;
+	unsigned long histogram[BUCKETS];
+	unsigned long max_late;
+	unsigned long long total_late;
+
+	CDGTimingStats() { Clear(); }
+	void Clear();
+	void Wakeup(unsigned long late_us)
+	{
+		int b = 0;
+		while ((b < BUCKETS - 1) && (late_us >= bounds[b]))
+			b++;
+		histogram[b]++;
+		wakeups++;
+		total_late += late_us;
+		if (late_us > max_late)
+			max_late = late_us;
+	}
+	// On stderr
+	void Report(const char *title) const;
+};
@@ -0,0 +1,291 @@
+#include "Karaoke.h"
+#include <atomic>
+#include <new>
+#include <iostream>
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/*
+** Fan-out of decoded frames to other local processes
+**  The publisher owns a POSIX shared memory ring of frames. Each slot is
+**  guarded by a sequence lock: the count is odd while the slot is being
+**  written, so subscribers read in place and retry if it changed under
+**  them. Subscribers never write to the segment.
+*/
+
+static const unsigned int RING_MAGIC = 0x43444752;	// "CDGR"
+static const int RING_SLOTS = 8;
+
+struct SharedFrame
+{
+	std::atomic<unsigned int> seq;
+	unsigned long frame;
+	unsigned long time;
+	unsigned short colors[CDGScreenHandler::MAX_COLORS];
+	CDGScreenHandler::TileMap changed;
+	CDGScreenHandler::Screen screen;
+};
+
+struct SharedRing
+{
+	unsigned int magic;
+	std::atomic<bool> closed;
+	// Number of the last complete frame, 0 until the first one
+	std::atomic<unsigned long> latest;
+	SharedFrame frames[RING_SLOTS];
+};
+
+static std::string SharedName(const char *name)
+{
+	return (name[0] == '/') ? std::string(name) : std::string("/") + name;
+}
+
+class SharedScreenPublisher : public CDGScreenHandler
+{
+private:
+	std::string shm_name;
+	SharedRing *ring;
+	CDGScreenHandler *local;
+	unsigned short colors[MAX_COLORS];
+	bool colors_changed;
+	unsigned long frame;
+	// Frame that last modified each tile, lets a slot be brought up to
+	//  date by copying only the tiles changed since it was last written
+	unsigned long tile_frame[TILE_ROWS][TILE_COLS];
+
+	void Publish(const Screen *s, const TileMap *changed, unsigned long time)
+	{
+		frame++;
+		for (int r = 0; r < TILE_ROWS; r++)
+			for (int c = 0; c < TILE_COLS; c++)
+				if (!changed || (*changed)[r][c])
+					tile_frame[r][c] = frame;
+
+		SharedFrame *f = &ring->frames[frame % RING_SLOTS];
+		unsigned long previous = f->frame;
+		unsigned int seq = f->seq.load(std::memory_order_relaxed);
+		f->seq.store(seq + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+
+		for (int r = 0; r < TILE_ROWS; r++)
+			for (int c = 0; c < TILE_COLS; c++)
+			{
+				if (previous && (tile_frame[r][c] <= previous))
+					continue;
+				for (int i = r * CHAR_HEIGHT; i < (r + 1) * CHAR_HEIGHT; i++)
+					memcpy(&f->screen[i][c * CHAR_WIDTH], &(*s)[i][c * CHAR_WIDTH], CHAR_WIDTH);
+			}
+		if (changed)
+			memcpy(f->changed, changed, sizeof(TileMap));
+		else
+			memset(f->changed, 1, sizeof(TileMap));
+		memcpy(f->colors, colors, sizeof(colors));
+		f->time = time;
+		f->frame = frame;
+
+		f->seq.store(seq + 2, std::memory_order_release);
+		ring->latest.store(frame, std::memory_order_release);
+		colors_changed = false;
+	}
+
+public:
+	SharedScreenPublisher(const char *name, CDGScreenHandler *h)
+	{
+		ring = NULL;
+		local = h;
+		colors_changed = false;
+		frame = 0;
+		memset(colors, 0, sizeof(colors));
+		memset(tile_frame, 0, sizeof(tile_frame));
+		shm_name = SharedName(name);
+
+		int fd = shm_open(shm_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+		{
+			std::cerr << "Cannot create shared memory " << shm_name << "\n";
+			return;
+		}
+		if (ftruncate(fd, sizeof(SharedRing)))
+		{
+			std::cerr << "Cannot size shared memory " << shm_name << "\n";
+			close(fd);
+			shm_unlink(shm_name.c_str());
+			return;
+		}
+		void *map = mmap(NULL, sizeof(SharedRing), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (map == MAP_FAILED)
+		{
+			std::cerr << "Cannot map shared memory " << shm_name << "\n";
+			shm_unlink(shm_name.c_str());
+			return;
+		}
+		// Freshly truncated segment is zero filled
+		ring = static_cast<SharedRing *>(map);
+		for (int i = 0; i < RING_SLOTS; i++)
+			new (&ring->frames[i].seq) std::atomic<unsigned int>(0);
+		new (&ring->closed) std::atomic<bool>(false);
+		new (&ring->latest) std::atomic<unsigned long>(0);
+		ring->magic = RING_MAGIC;
+	}
+
+	~SharedScreenPublisher()
+	{
+		if (ring)
+		{
+			ring->closed.store(true, std::memory_order_release);
+			munmap(ring, sizeof(SharedRing));
+			shm_unlink(shm_name.c_str());
+		}
+	}
+
+	void InitColors(const unsigned short c[])
+	{
+		memcpy(colors, c, sizeof(colors));
+		colors_changed = true;
+		if (local)
+			local->InitColors(c);
+	}
+
+	void Display(const Screen *s)
+	{
+		if (ring)
+			Publish(s, NULL, 0);
+		if (local)
+			local->Display(s);
+	}
+
+	void DisplayChanged(const Screen *s, const TileMap *changed, unsigned long time)
+	{
+		bool any = colors_changed;
+		for (int r = 0; (r < TILE_ROWS) && !any; r++)
+			any = (memchr((*changed)[r], 1, TILE_COLS) != NULL);
+		if (ring && any)
+			Publish(s, changed, time);
+		if (local)
+			local->DisplayChanged(s, changed, time);
+	}
+};
+
+class SharedScreenSubscriber : public CDGScreenSubscriber
+{
+private:
+	const SharedRing *ring;
+	unsigned long shown;
+	unsigned short colors[CDGScreenHandler::MAX_COLORS];
+	CDGScreenHandler::TileMap all_changed;
+	// Tiles changed by every frame published since the one we showed
+	CDGScreenHandler::TileMap merged;
+	static const int MAX_RETRIES = 4;
+
+	// False when a frame in between has already been overwritten
+	bool MergeChanged(unsigned long latest)
+	{
+		if ((shown == 0) || (latest - shown > (unsigned long)RING_SLOTS))
+			return false;
+		memset(merged, 0, sizeof(merged));
+		for (unsigned long n = shown + 1; n <= latest; n++)
+		{
+			const SharedFrame *f = &ring->frames[n % RING_SLOTS];
+			unsigned int seq = f->seq.load(std::memory_order_acquire);
+			if ((seq & 1) || (f->frame != n))
+				return false;
+			const unsigned char *src = &f->changed[0][0];
+			unsigned char *dst = &merged[0][0];
+			for (size_t i = 0; i < sizeof(merged); i++)
+				dst[i] |= src[i];
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (f->seq.load(std::memory_order_relaxed) != seq)
+				return false;
+		}
+		return true;
+	}
+public:
+	SharedScreenSubscriber(const char *name)
+	{
+		ring = NULL;
+		shown = 0;
+		memset(colors, 0xFF, sizeof(colors));
+		memset(all_changed, 1, sizeof(all_changed));
+
+		std::string shm_name = SharedName(name);
+		int fd = shm_open(shm_name.c_str(), O_RDONLY, 0);
+		if (fd < 0)
+		{
+			std::cerr << "No publisher on " << shm_name << "\n";
+			return;
+		}
+		void *map = mmap(NULL, sizeof(SharedRing), PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (map == MAP_FAILED)
+		{
+			std::cerr << "Cannot map shared memory " << shm_name << "\n";
+			return;
+		}
+		ring = static_cast<const SharedRing *>(map);
+		if (ring->magic != RING_MAGIC)
+		{
+			std::cerr << "Not a CDG frame ring: " << shm_name << "\n";
+			munmap((void *)ring, sizeof(SharedRing));
+			ring = NULL;
+		}
+	}
+
+	~SharedScreenSubscriber()
+	{
+		if (ring)
+			munmap((void *)ring, sizeof(SharedRing));
+	}
+
+	bool Poll(CDGScreenHandler *h)
+	{
+		if (ring == NULL)
+			return false;
+		for (int retry = 0; retry < MAX_RETRIES; retry++)
+		{
+			unsigned long latest = ring->latest.load(std::memory_order_acquire);
+			if (latest == shown)
+				return !ring->closed.load(std::memory_order_acquire);
+
+			const SharedFrame *f = &ring->frames[latest % RING_SLOTS];
+			unsigned int seq = f->seq.load(std::memory_order_acquire);
+			if ((seq & 1) || (f->frame != latest))
+				continue;
+
+			// Rendered straight from the ring, if the publisher wrapped
+			//  around onto this slot meanwhile the frame is shown again
+			bool new_colors = memcmp(colors, f->colors, sizeof(colors)) != 0;
+			if (new_colors)
+				h->InitColors(f->colors);
+			// Tile maps are relative to the previous frame, those of the
+			//  frames skipped since the one we showed are merged
+			const CDGScreenHandler::TileMap *changed = (!new_colors && MergeChanged(latest)) ? &merged : &all_changed;
+			h->DisplayChanged(&f->screen, changed, f->time);
+
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (f->seq.load(std::memory_order_relaxed) != seq)
+			{
+				memset(colors, 0xFF, sizeof(colors));
+				shown = 0;
+				continue;
+			}
+			memcpy(colors, f->colors, sizeof(colors));
+			shown = latest;
+			return true;
+		}
+		return !ring->closed.load(std::memory_order_acquire);
+	}
+};
+
+CDGScreenHandler *CDGScreenHandler::GetPublisher(const char *name, CDGScreenHandler *local)
+{
+	return new SharedScreenPublisher(name, local);
+}
+
+CDGScreenSubscriber *CDGScreenSubscriber::GetSubscriber(const char *name)
+{
+	return new SharedScreenSubscriber(name);
+}
@@ -0,0 +1,154 @@
+#include "Karaoke.h"
+#include "SimAudio.h"
+#include <pthread.h>
+#include <cmath>
+#include <time.h>
+
+class SimulatedAudioPlayer : public SimulatedAudio
+{
+private:
+	SimulatedAudioConfig config;
+	pthread_mutex_t safety;
+	bool playing;
+	struct timespec begin;
+	unsigned long long rng;
+	// Wall clock microseconds since Play()
+	unsigned long long stall_start, stall_len, stalled;
+	unsigned long long base_samples;
+	unsigned long stalls;
+	unsigned int last_reported;
+
+	unsigned long long Random()
+	{
+		// xorshift64*
+		rng ^= rng >> 12;
+		rng ^= rng << 25;
+		rng ^= rng >> 27;
+		return rng * 2685821657736338717ULL;
+	}
+
+	double Uniform()
+	{
+		return (Random() >> 11) * (1.0 / 9007199254740992.0);
+	}
+
+	void ScheduleStall(unsigned long long after)
+	{
+		stall_len = (unsigned long long)config.stall_ms * 1000;
+		if ((config.stalls_per_minute <= 0) || (stall_len == 0))
+		{
+			stall_start = ~0ULL / 2;
+			return;
+		}
+		// Poisson arrivals
+		double mean_gap = 60e6 / config.stalls_per_minute;
+		stall_start = after + (unsigned long long)(-std::log(1.0 - Uniform()) * mean_gap);
+	}
+
+	unsigned long long Now()
+	{
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return (now.tv_sec - begin.tv_sec) * 1000000ULL + (now.tv_nsec - begin.tv_nsec) / 1000;
+	}
+
+	// Samples produced by the device up to now
+	unsigned long long Samples()
+	{
+		if (!playing)
+			return base_samples;
+		unsigned long long now = Now();
+		while (now >= stall_start + stall_len)
+		{
+			stalled += stall_len;
+			stalls++;
+			ScheduleStall(stall_start + stall_len);
+		}
+		unsigned long long frozen = stalled + ((now > stall_start) ? now - stall_start : 0);
+		double running = (now - frozen) * (1.0 + config.drift_ppm / 1e6);
+		return base_samples + (unsigned long long)(running * config.sample_rate / 1e6);
+	}
+
+public:
+	SimulatedAudioPlayer(const SimulatedAudioConfig &c)
+	{
+		config = c;
+		if (config.sample_rate == 0)
+			config.sample_rate = 44100;
+		if (config.granularity_ms == 0)
+			config.granularity_ms = 1;
+		pthread_mutex_init(&safety, NULL);
+		playing = false;
+		rng = config.seed ? config.seed : 1;
+		stalled = 0;
+		stalls = 0;
+		base_samples = 0;
+		last_reported = 0;
+		ScheduleStall(0);
+	}
+
+	~SimulatedAudioPlayer()
+	{
+		pthread_mutex_destroy(&safety);
+	}
+
+	bool Play()
+	{
+		pthread_mutex_lock(&safety);
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		playing = true;
+		pthread_mutex_unlock(&safety);
+		return true;
+	}
+
+	unsigned int GetPlayPosition()
+	{
+		pthread_mutex_lock(&safety);
+		long long us = Samples() * 1000000ULL / config.sample_rate;
+		if (config.jitter_us)
+			us += (long long)(Random() % (2 * config.jitter_us + 1)) - config.jitter_us;
+		unsigned int ms = (us > 0) ? us / 1000 : 0;
+		ms -= ms % config.granularity_ms;
+		// Like a real device the reported position never goes back
+		if (ms < last_reported)
+			ms = last_reported;
+		last_reported = ms;
+		pthread_mutex_unlock(&safety);
+		return ms;
+	}
+
+	bool SetPlayPosition(unsigned int ms)
+	{
+		pthread_mutex_lock(&safety);
+		// Device restarts from ms, stall schedule starts over with it
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		base_samples = (unsigned long long)ms * config.sample_rate / 1000;
+		stalled = 0;
+		ScheduleStall(0);
+		last_reported = ms;
+		pthread_mutex_unlock(&safety);
+		return true;
+	}
+
+	void Update()
+	{
+	}
+
+	unsigned long long GetTruePosition()
+	{
+		pthread_mutex_lock(&safety);
+		unsigned long long us = Samples() * 1000000ULL / config.sample_rate;
+		pthread_mutex_unlock(&safety);
+		return us;
+	}
+
+	unsigned long GetStalls()
+	{
+		return stalls;
+	}
+};
+
+SimulatedAudio *SimulatedAudio::GetPlayer(const SimulatedAudioConfig &config)
+{
+	return new SimulatedAudioPlayer(config);
+}
@@ -0,0 +1,40 @@
+/*
+** Simulated audio output for measuring lyric sync without a sound card
+**  Play position comes from a virtual sample clock running off the
+**  monotonic clock, with configurable drift, stalls, reporting jitter
+**  and position granularity. Random events come from a seeded
+**  generator so a run can be repeated.
+**
+** (c) Niranjan Nagar
+*/
+
+struct SimulatedAudioConfig
+{
+	unsigned int sample_rate;
+	double drift_ppm;			// device clock error, positive runs fast
+	unsigned int jitter_us;		// noise on reported positions, +/-
+	unsigned int granularity_ms;	// reported positions are multiples of this
+	double stalls_per_minute;	// device stops producing samples
+	unsigned int stall_ms;
+	unsigned long long seed;
+
+	SimulatedAudioConfig()
+	{
+		sample_rate = 44100;
+		drift_ppm = 0;
+		jitter_us = 0;
+		granularity_ms = 1;
+		stalls_per_minute = 0;
+		stall_ms = 0;
+		seed = 1;
+	}
+};
+
+class SimulatedAudio : public KaraokeAudio
+{
+public:
+	// Position actually heard, free of jitter and granularity
+	virtual unsigned long long GetTruePosition() = 0;	// microseconds
+	virtual unsigned long GetStalls() = 0;
+	static SimulatedAudio *GetPlayer(const SimulatedAudioConfig &config);
+};
@@ -0,0 +1,290 @@
+#include "Karaoke.h"
+#include "SongCache.h"
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+// What is allocated, not what is used
+size_t CDGSongCache::Song::Size() const
+{
+	return sizeof(Song) + base.capacity() + packets.capacity() * sizeof(SubCode) +
+		index.capacity() * sizeof(unsigned int) + keyframes.capacity() * sizeof(Keyframe) +
+		lyrics.capacity() * sizeof(CDGLyricEvent) + audio.capacity();
+}
+
+// Collects lyric events into the song being loaded
+class LyricRecorder : public CDGLyricListener
+{
+private:
+	std::vector<CDGLyricEvent> &events;
+public:
+	LyricRecorder(std::vector<CDGLyricEvent> &e) : events(e) {}
+	void LyricEvent(const CDGLyricEvent &e)
+	{
+		events.push_back(e);
+	}
+};
+
+/*
+** Replays a cached song packet by packet, handing out a shared empty
+**  packet wherever the original file had one so pacing is unchanged
+*/
+class CachedSongReader : public CDGReader
+{
+private:
+	CDGSongCache::SongPtr song;
+	unsigned long read_ptr;
+	size_t next;
+	SubCode empty;
+public:
+	CachedSongReader(CDGSongCache::SongPtr s)
+	{
+		song = s;
+		read_ptr = 0;
+		next = 0;
+		memset(&empty, 0, sizeof(empty));
+	}
+
+	bool Done()
+	{
+		return read_ptr >= song->packet_count;
+	}
+
+	bool Start()
+	{
+		return true;
+	}
+
+	const SubCode *ReadNext()
+	{
+		if (read_ptr >= song->packet_count)
+			return NULL;
+		if ((next < song->index.size()) && (song->index[next] == read_ptr))
+		{
+			read_ptr++;
+			return &song->packets[next++];
+		}
+		read_ptr++;
+		return &empty;
+	}
+
+	bool Seek(unsigned long packet)
+	{
+		if (packet > song->packet_count)
+			return false;
+		read_ptr = packet;
+		next = std::lower_bound(song->index.begin(), song->index.end(), packet) - song->index.begin();
+		return true;
+	}
+};
+
+CDGSongCache::CDGSongCache(size_t budget_bytes, Policy p, unsigned int keyframe_ms)
+{
+	budget = budget_bytes;
+	used = 0;
+	policy = p;
+	keyframe_packets = CDGMsToPacket(keyframe_ms ? keyframe_ms : 10000);
+	tick = 0;
+	hits = misses = evictions = 0;
+	pthread_mutex_init(&safety, NULL);
+}
+
+CDGSongCache::~CDGSongCache()
+{
+	pthread_mutex_destroy(&safety);
+}
+
+CDGSongCache::Song *CDGSongCache::Load(const std::string &base)
+{
+	std::string cdg_name = base + ".cdg";
+	CDGReader *rdr = CDGReader::GetMappedReader(cdg_name.c_str());
+	if ((rdr == NULL) || !rdr->Start())
+	{
+		std::cerr << "Cannot cache " << cdg_name << "\n";
+		delete rdr;
+		return NULL;
+	}
+	CDGParser *parser = CDGParser::GetParser(NULL, NULL, NULL);
+	Song *song = new Song();
+	song->base = base;
+	LyricRecorder recorder(song->lyrics);
+	parser->SetLyricListener(&recorder);
+
+	const SubCode *s;
+	unsigned long packet = 0;
+	while ((s = rdr->ReadNext()) != NULL)
+	{
+		if ((packet % keyframe_packets) == 0)
+		{
+			song->keyframes.push_back(Keyframe());
+			Keyframe &k = song->keyframes.back();
+			const unsigned char *pixels = &(*parser->GetScreen())[0][0];
+			k.packet = packet;
+			memcpy(k.colors, parser->GetColors(), sizeof(k.colors));
+			for (size_t i = 0; i < sizeof(k.pixels); i++)
+				k.pixels[i] = (pixels[2 * i] << 4) | (pixels[2 * i + 1] & 0x0F);
+		}
+		if ((s->command & 0x3F) == 9)
+		{
+			song->packets.push_back(*s);
+			song->index.push_back(packet);
+			parser->Decode(s, packet);
+		}
+		packet++;
+	}
+	song->packet_count = packet;
+	// Growth slack is given back, the song stays as loaded from now on
+	std::vector<SubCode>(song->packets).swap(song->packets);
+	std::vector<unsigned int>(song->index).swap(song->index);
+	std::vector<Keyframe>(song->keyframes).swap(song->keyframes);
+	std::vector<CDGLyricEvent>(song->lyrics).swap(song->lyrics);
+	delete parser;
+	delete rdr;
+
+	std::string mp3_name = base + ".mp3";
+	FILE *f = fopen(mp3_name.c_str(), "rb");
+	if (f)
+	{
+		if ((fseek(f, 0, SEEK_END) == 0) && (ftell(f) > 0))
+		{
+			song->audio.resize(ftell(f));
+			rewind(f);
+			if (fread(&song->audio[0], 1, song->audio.size(), f) != song->audio.size())
+			{
+				std::cerr << "Cannot cache " << mp3_name << "\n";
+				song->audio.clear();
+			}
+		}
+		fclose(f);
+	}
+	return song;
+}
+
+void CDGSongCache::Evict(const std::string &keep)
+{
+	while (used > budget)
+	{
+		std::map<std::string, Entry>::iterator victim = songs.end();
+		for (std::map<std::string, Entry>::iterator it = songs.begin(); it != songs.end(); ++it)
+		{
+			if (it->first == keep)
+				continue;
+			if (victim == songs.end())
+				victim = it;
+			else if ((policy == LFU) && (it->second.uses != victim->second.uses))
+			{
+				if (it->second.uses < victim->second.uses)
+					victim = it;
+			}
+			else if (it->second.last_used < victim->second.last_used)
+				victim = it;
+		}
+		if (victim == songs.end())
+			return;
+		used -= victim->second.song->Size();
+		songs.erase(victim);
+		evictions++;
+	}
+}
+
+CDGSongCache::SongPtr CDGSongCache::Get(const std::string &base)
+{
+	pthread_mutex_lock(&safety);
+	std::map<std::string, Entry>::iterator it = songs.find(base);
+	if (it != songs.end())
+	{
+		it->second.last_used = ++tick;
+		it->second.uses++;
+		hits++;
+		SongPtr song = it->second.song;
+		pthread_mutex_unlock(&safety);
+		return song;
+	}
+	misses++;
+	pthread_mutex_unlock(&safety);
+
+	// Loaded without the lock so other players are not held up by disk
+	SongPtr song(Load(base));
+	if (!song)
+		return song;
+
+	pthread_mutex_lock(&safety);
+	it = songs.find(base);
+	if (it != songs.end())
+		song = it->second.song;
+	else if (song->Size() <= budget)
+	{
+		Entry &e = songs[base];
+		e.song = song;
+		e.last_used = ++tick;
+		e.uses = 1;
+		used += song->Size();
+		Evict(base);
+	}
+	pthread_mutex_unlock(&safety);
+	return song;
+}
+
+void CDGSongCache::Stats(unsigned long &h, unsigned long &m, unsigned long &e, size_t &bytes)
+{
+	pthread_mutex_lock(&safety);
+	h = hits;
+	m = misses;
+	e = evictions;
+	bytes = used;
+	pthread_mutex_unlock(&safety);
+}
+
+CDGReader *CDGSongCache::GetReader(SongPtr song)
+{
+	if (!song)
+		return NULL;
+	return new CachedSongReader(song);
+}
+
+KaraokeAudio *CDGSongCache::GetPlayer(SongPtr song)
+{
+	if (!song || song->audio.empty())
+		return NULL;
+	return KaraokeAudio::GetPlayer(&song->audio[0], song->audio.size());
+}
+
+bool CDGSongCache::Seek(SongPtr song, CDGParser *parser, CDGReader *rdr, unsigned int ms)
+{
+	unsigned long target = CDGMsToPacket(ms);
+	if (!song || !parser || !rdr || (target >= song->packet_count) || song->keyframes.empty())
+		return false;
+
+	// Last snapshot at or before the target, then decode up to it
+	size_t k = 0;
+	while ((k + 1 < song->keyframes.size()) && (song->keyframes[k + 1].packet <= target))
+		k++;
+	const Keyframe &key = song->keyframes[k];
+	std::vector<unsigned char> pixels(sizeof(CDGScreenHandler::Screen));
+	for (size_t i = 0; i < sizeof(key.pixels); i++)
+	{
+		pixels[2 * i] = key.pixels[i] >> 4;
+		pixels[2 * i + 1] = key.pixels[i] & 0x0F;
+	}
+	const CDGScreenHandler::Screen *screen = reinterpret_cast<const CDGScreenHandler::Screen *>(&pixels[0]);
+	if (!parser->Restore(screen, key.colors, key.packet) || !rdr->Seek(key.packet))
+		return false;
+	for (unsigned long p = key.packet; p < target; p++)
+		parser->Decode(rdr->ReadNext(), p);
+	return parser->Restore(NULL, NULL, target);
+}
+
+const CDGLyricEvent *CDGSongCache::NextLine(SongPtr song, unsigned int ms)
+{
+	if (!song)
+		return NULL;
+	unsigned long us = (unsigned long)ms * 1000;
+	for (size_t i = 0; i < song->lyrics.size(); i++)
+	{
+		const CDGLyricEvent &e = song->lyrics[i];
+		if ((e.type == CDGLyricEvent::LINE_START) && (e.time > us))
+			return &e;
+	}
+	return NULL;
+}
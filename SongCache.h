@@ -0,0 +1,77 @@
+/*
+** In-process cache of songs played often
+**  A cached song holds its CD+G packets with the empty ones squeezed
+**  out, screen snapshots taken every few seconds for seeking, the lyric
+**  events and the encoded audio. Songs are shared read-only: readers
+**  and players built from a song keep it alive even after the cache
+**  has evicted it.
+**
+** (c) Niranjan Nagar
+*/
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <pthread.h>
+
+class CDGSongCache
+{
+public:
+	enum Policy { LRU, LFU };
+
+	struct Keyframe
+	{
+		unsigned long packet;
+		unsigned short colors[CDGScreenHandler::MAX_COLORS];
+		// Two pixels per byte
+		unsigned char pixels[CDGScreenHandler::HEIGHT * CDGScreenHandler::WIDTH / 2];
+	};
+
+	struct Song
+	{
+		std::string base;
+		unsigned long packet_count;
+		// Graphics packets only, index[i] is the position of packets[i]
+		std::vector<SubCode> packets;
+		std::vector<unsigned int> index;
+		std::vector<Keyframe> keyframes;
+		// Line starts and wipe progress found while loading
+		std::vector<CDGLyricEvent> lyrics;
+		std::vector<char> audio;
+		size_t Size() const;
+	};
+	typedef std::shared_ptr<const Song> SongPtr;
+
+	CDGSongCache(size_t budget_bytes, Policy policy = LRU, unsigned int keyframe_ms = 10000);
+	~CDGSongCache();
+	// Cached song for <base>.cdg / <base>.mp3, loaded on a miss
+	SongPtr Get(const std::string &base);
+	void Stats(unsigned long &hits, unsigned long &misses, unsigned long &evictions, size_t &bytes);
+
+	// Reader over the cached packets, keeps the song alive
+	static CDGReader *GetReader(SongPtr song);
+	// Player over the cached audio, the song must outlive it
+	static KaraokeAudio *GetPlayer(SongPtr song);
+	// Before Start(), makes parser and reader resume at ms
+	static bool Seek(SongPtr song, CDGParser *parser, CDGReader *rdr, unsigned int ms);
+	// First line starting after ms, NULL past the last one
+	static const CDGLyricEvent *NextLine(SongPtr song, unsigned int ms);
+
+private:
+	struct Entry
+	{
+		SongPtr song;
+		unsigned long last_used;
+		unsigned long uses;
+	};
+	std::map<std::string, Entry> songs;
+	size_t budget, used;
+	Policy policy;
+	unsigned int keyframe_packets;
+	unsigned long tick;
+	unsigned long hits, misses, evictions;
+	pthread_mutex_t safety;
+
+	Song *Load(const std::string &base);
+	void Evict(const std::string &keep);
+};
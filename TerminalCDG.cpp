@@ -0,0 +1,366 @@
+#include "Karaoke.h"
+#include <iostream>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <errno.h>
+
+/*
+** Headless player drawing on an ANSI truecolor terminal
+**  Every character cell is an upper half block, its foreground is the
+**  upper pixel and its background the lower pixel. Only cells that
+**  changed since the last frame are redrawn, each frame goes out as a
+**  single write(). Frames are sent by a present thread at a fixed rate,
+**  so changes are shown even when no packets follow them for a while.
+*/
+class TerminalDisplay : public CDGScreenHandler
+{
+private:
+	static const unsigned short UNKNOWN = 0xFFFF;
+	int step;				// screen pixels per cell horizontally, 2*step vertically
+	int rows, cols;
+	long frame_interval;	// microseconds
+	unsigned short screen_colors[MAX_COLORS];
+	const Screen *screen;
+	// Tiles touched since the last frame went out
+	TileMap pending;
+	bool any_pending;
+	// Colors currently on the terminal, upper and lower pixel of each cell
+	std::vector<unsigned short> shown;
+	std::vector<char> out;
+	size_t len;
+	unsigned long frames, bytes;
+	pthread_t thread;
+	bool thread_valid;
+	volatile bool stop;
+	pthread_mutex_t safety;
+
+	void Put(const char *s, size_t n)
+	{
+		memcpy(&out[len], s, n);
+		len += n;
+	}
+
+	void Dec(unsigned int v)
+	{
+		char tmp[12];
+		int n = 0;
+		do {
+			tmp[n++] = '0' + (v % 10);
+			v /= 10;
+		} while (v);
+		while (n)
+			out[len++] = tmp[--n];
+	}
+
+	void RGB(unsigned short c)
+	{
+		// 4 bits per channel to 8
+		Dec(((c >> 8) & 0x0F) * 17);
+		out[len++] = ';';
+		Dec(((c >> 4) & 0x0F) * 17);
+		out[len++] = ';';
+		Dec((c & 0x0F) * 17);
+	}
+
+	static void *Present(void *ptr)
+	{
+		TerminalDisplay *obj = static_cast<TerminalDisplay *>(ptr);
+		struct timespec next;
+		clock_gettime(CLOCK_MONOTONIC, &next);
+		while (!obj->stop)
+		{
+			next.tv_nsec += obj->frame_interval * 1000;
+			while (next.tv_nsec >= 1000000000)
+			{
+				next.tv_sec++;
+				next.tv_nsec -= 1000000000;
+			}
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+				;
+			pthread_mutex_lock(&obj->safety);
+			obj->Render();
+			pthread_mutex_unlock(&obj->safety);
+		}
+		return NULL;
+	}
+
+	void Render()
+	{
+		if (!screen || !any_pending)
+			return;
+
+		const int cells_per_tile_x = CHAR_WIDTH / step;
+		const int cells_per_tile_y = CHAR_HEIGHT / (2 * step);
+		unsigned short fg = UNKNOWN, bg = UNKNOWN;
+		int cur_row = -1, cur_col = -1;
+		len = 0;
+
+		for (int r = 0; r < rows; r++)
+		{
+			const unsigned char *pending_row = pending[r / cells_per_tile_y];
+			const unsigned char *upper = (*screen)[2 * r * step];
+			const unsigned char *lower = (*screen)[(2 * r + 1) * step];
+			for (int c = 0; c < cols; c++)
+			{
+				if (!pending_row[c / cells_per_tile_x])
+				{
+					c += cells_per_tile_x - 1 - (c % cells_per_tile_x);
+					continue;
+				}
+				unsigned short up = screen_colors[upper[c * step]];
+				unsigned short down = screen_colors[lower[c * step]];
+				unsigned short *cell = &shown[2 * (r * cols + c)];
+				if ((cell[0] == up) && (cell[1] == down))
+					continue;
+				cell[0] = up;
+				cell[1] = down;
+
+				if (r != cur_row)
+				{
+					Put("\033[", 2);
+					Dec(r + 1);
+					out[len++] = ';';
+					Dec(c + 1);
+					out[len++] = 'H';
+				}
+				else if (c != cur_col)
+				{
+					Put("\033[", 2);
+					Dec(c - cur_col);
+					out[len++] = 'C';
+				}
+
+				// Solid cells only need the background
+				bool need_fg = (up != down) && (up != fg);
+				bool need_bg = (down != bg);
+				if (need_fg || need_bg)
+				{
+					Put("\033[", 2);
+					if (need_fg)
+					{
+						Put("38;2;", 5);
+						RGB(up);
+						fg = up;
+					}
+					if (need_bg)
+					{
+						if (need_fg)
+							out[len++] = ';';
+						Put("48;2;", 5);
+						RGB(down);
+						bg = down;
+					}
+					out[len++] = 'm';
+				}
+				if (up == down)
+					out[len++] = ' ';
+				else
+					Put("\xE2\x96\x80", 3);
+				cur_row = r;
+				cur_col = c + 1;
+			}
+		}
+		memset(pending, 0, sizeof(pending));
+		any_pending = false;
+
+		size_t done = 0;
+		while (done < len)
+		{
+			ssize_t n = write(1, &out[done], len - done);
+			if (n <= 0)
+				break;
+			done += n;
+		}
+		frames++;
+		bytes += len;
+	}
+
+public:
+	TerminalDisplay(int scale, int fps)
+	{
+		step = ((scale == 2) || (scale == 3) || (scale == 6)) ? scale : 1;
+		rows = HEIGHT / (2 * step);
+		cols = WIDTH / step;
+		frame_interval = 1000000 / (fps > 0 ? fps : 30);
+		memset(screen_colors, 0, sizeof(screen_colors));
+		memset(pending, 1, sizeof(pending));
+		any_pending = true;
+		screen = NULL;
+		frames = bytes = 0;
+		thread_valid = false;
+		stop = false;
+		pthread_mutex_init(&safety, NULL);
+		shown.assign(2 * rows * cols, UNKNOWN);
+		// Worst case every cell with a cursor move and both colors
+		out.resize(rows * cols * 64);
+		len = 0;
+
+		const char init[] = "\033[0m\033[2J\033[?25l";
+		if (write(1, init, sizeof(init) - 1) < 0)
+			perror("write");
+	}
+
+	~TerminalDisplay()
+	{
+		Stop();
+		pthread_mutex_destroy(&safety);
+		char fini[32];
+		int n = snprintf(fini, sizeof(fini), "\033[0m\033[%d;1H\033[?25h\n", rows + 1);
+		if (write(1, fini, n) < 0)
+			perror("write");
+		if (frames)
+			fprintf(stderr, "%lu frames, %lu bytes/frame\n", frames, bytes / frames);
+	}
+
+	bool Start()
+	{
+		if (pthread_create(&thread, NULL, Present, (void *)this))
+		{
+			std::cerr << "TerminalDisplay::Start - Failed thread\n";
+			return false;
+		}
+		thread_valid = true;
+		return true;
+	}
+
+	// Joins the present thread and sends the last frame, the screen belongs
+	//  to the parser so this must happen before it is deleted
+	void Stop()
+	{
+		if (thread_valid)
+		{
+			stop = true;
+			pthread_join(thread, NULL);
+			thread_valid = false;
+		}
+		Render();
+		screen = NULL;
+	}
+
+	void InitColors(const unsigned short colors[])
+	{
+		pthread_mutex_lock(&safety);
+		bool changed = false;
+		for (int i = 0; i < MAX_COLORS; i++)
+			if (screen_colors[i] != colors[i])
+			{
+				screen_colors[i] = colors[i];
+				changed = true;
+			}
+		// Cells whose colors did not really change are filtered in Render()
+		if (changed)
+		{
+			memset(pending, 1, sizeof(pending));
+			any_pending = true;
+		}
+		pthread_mutex_unlock(&safety);
+	}
+
+	void Display(const Screen *s)
+	{
+		pthread_mutex_lock(&safety);
+		screen = s;
+		memset(pending, 1, sizeof(pending));
+		any_pending = true;
+		pthread_mutex_unlock(&safety);
+	}
+
+	// Runs on the parser thread, only records what the next frame redraws
+	void DisplayChanged(const Screen *s, const TileMap *changed, unsigned long time)
+	{
+		pthread_mutex_lock(&safety);
+		screen = s;
+		for (int r = 0; r < TILE_ROWS; r++)
+			for (int c = 0; c < TILE_COLS; c++)
+				if ((*changed)[r][c])
+				{
+					pending[r][c] = 1;
+					any_pending = true;
+				}
+		pthread_mutex_unlock(&safety);
+	}
+};
+
+const unsigned short TerminalDisplay::UNKNOWN;
+
+int main(int argc, char *argv[])
+{
+	bool mute = false;
+	int scale = 1, fps = 30;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "ms:r:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'm':
+				mute = true;
+				break;
+			case 's':
+				scale = atoi(optarg);
+				break;
+			case 'r':
+				fps = atoi(optarg);
+				break;
+			default:
+				argc = 0;
+		}
+	}
+
+	if (argc != optind + 1)
+	{
+		std::cerr << "Usage: " << (argc ? argv[0] : "cdgterm") << " [-m] [-s 1|2|3|6] [-r fps] <base file>\n"
+			<< "\t-m  no audio, paced by the wall clock\n"
+			<< "\t-s  screen pixels per character cell\n"
+			<< "\t-r  maximum frames per second sent to the terminal\n";
+		return -1;
+	}
+
+	char *base = argv[optind];
+	char *cdg_name = new char[strlen(base) + 5];
+	char *mp3_name = new char[strlen(base) + 5];
+	sprintf(cdg_name, "%s.cdg", base);
+	sprintf(mp3_name, "%s.mp3", base);
+
+	CDGReader *rdr = CDGReader::GetReader(cdg_name);
+	if (rdr == NULL)
+	{
+		std::cerr << "Cannot create File Reader\n";
+		return -1;
+	}
+	KaraokeAudio *player = NULL;
+	if (!mute && ((player = KaraokeAudio::GetPlayer(mp3_name)) == NULL))
+	{
+		std::cerr << "Cannot create FMOD Audio\n";
+		delete rdr;
+		return -1;
+	}
+	TerminalDisplay *td = new TerminalDisplay(scale, fps);
+	CDGParser *parser = CDGParser::GetParser(td, player, rdr);
+	if (parser == NULL)
+	{
+		delete td;
+		delete player;
+		delete rdr;
+		std::cerr << "Cannot create CDG Parser\n";
+		return -1;
+	}
+
+	td->Start();
+	parser->Start();
+	parser->WaitUntilDone();
+	td->Stop();
+
+	delete parser;
+	delete player;
+	delete rdr;
+	delete td;
+	delete[] cdg_name;
+	delete[] mp3_name;
+	return 0;
+}
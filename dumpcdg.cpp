@@ -0,0 +1,391 @@
+#include "Karaoke.h"
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <time.h>
+
+/*
+** CD+G disassembler and statistics
+**  dumpcdg [-s|-S] [-x] [-e] [-r] [-i instr,...] [-t from:to] file.cdg...
+**
+**  -s        per file and aggregate statistics after the listing
+**  -S        statistics only, no listing
+**  -x        raw packet bytes next to each instruction
+**  -e        also list packets that are not CD+G graphics
+**  -r        input is a raw subchannel dump, still interleaved
+**  -i        only list these instructions (names or numbers)
+**  -t        only list packets between from and to seconds
+*/
+
+static const int MAX_INSTRUCTIONS = 64;
+
+struct Stats
+{
+	unsigned long files;
+	unsigned long packets;
+	unsigned long empty;
+	unsigned long instructions[MAX_INSTRUCTIONS];
+	unsigned long scroll_offsets;
+	unsigned long corrected, dropped;
+	unsigned long long bytes;
+
+	void Add(const Stats &o)
+	{
+		files += o.files;
+		packets += o.packets;
+		empty += o.empty;
+		for (int i = 0; i < MAX_INSTRUCTIONS; i++)
+			instructions[i] += o.instructions[i];
+		scroll_offsets += o.scroll_offsets;
+		corrected += o.corrected;
+		dropped += o.dropped;
+		bytes += o.bytes;
+	}
+};
+
+/*
+** Output is formatted by hand into one large buffer and written out in
+**  big chunks, printf per field is what made the old dump slow
+*/
+class Output
+{
+private:
+	static const size_t SIZE = 1 << 16;
+	char buf[SIZE];
+	size_t len;
+public:
+	Output() { len = 0; }
+	~Output() { Flush(); }
+	void Flush()
+	{
+		if (len && (write(1, buf, len) < 0))
+			perror("write");
+		len = 0;
+	}
+	// Callers keep a line well under this, so a line never straddles a flush
+	void Reserve(size_t n)
+	{
+		if (len + n > SIZE)
+			Flush();
+	}
+	void Put(char c) { buf[len++] = c; }
+	void Put(const char *s)
+	{
+		while (*s)
+			buf[len++] = *s++;
+	}
+	void Hex(unsigned int v, int digits)
+	{
+		static const char hex[] = "0123456789ABCDEF";
+		for (int i = digits - 1; i >= 0; i--)
+			buf[len++] = hex[(v >> (4 * i)) & 0x0F];
+	}
+	void Dec(unsigned long v, int width = 0)
+	{
+		char tmp[24];
+		int n = 0;
+		do {
+			tmp[n++] = '0' + (v % 10);
+			v /= 10;
+		} while (v);
+		while (width-- > n)
+			buf[len++] = '0';
+		while (n)
+			buf[len++] = tmp[--n];
+	}
+	void Time(unsigned long packet)
+	{
+		unsigned long ms = CDGPacketToMs(packet);
+		Dec(ms / 60000, 2);
+		Put(':');
+		Dec((ms / 1000) % 60, 2);
+		Put('.');
+		Dec(ms % 1000, 3);
+	}
+};
+
+struct Filter
+{
+	bool instructions[MAX_INSTRUCTIONS];
+	unsigned long from, to;
+	bool empty;
+	bool raw;
+	bool list;
+	bool interleaved;
+};
+
+static void Disassemble(Output &out, const SubCode *s, unsigned long packet, const Filter &f)
+{
+	const unsigned char *d = s->data;
+	int instruction = s->instruction & 0x3F;
+
+	out.Reserve(256);
+	out.Time(packet);
+	out.Put(' ');
+	out.Dec(packet, 7);
+	out.Put("  ");
+	if (f.raw)
+	{
+		const unsigned char *b = (const unsigned char *)s;
+		for (size_t i = 0; i < sizeof(SubCode); i++)
+			out.Hex(b[i], 2);
+		out.Put("  ");
+	}
+	if ((s->command & 0x3F) != 9)
+	{
+		out.Put("(command ");
+		out.Hex(s->command & 0x3F, 2);
+		out.Put(")\n");
+		return;
+	}
+
+	out.Put(CDGInstructionName(instruction));
+	switch (instruction)
+	{
+		case MEMORY_PRESET:
+			out.Put(" color=");
+			out.Dec(d[0] & 0x0F);
+			out.Put(" repeat=");
+			out.Dec(d[1] & 0x0F);
+			break;
+		case BORDER_PRESET:
+		case DEF_TRANSPARENT_COLOR:
+			out.Put(" color=");
+			out.Dec(d[0] & 0x0F);
+			break;
+		case TILE_BLOCK_NORMAL:
+		case TILE_BLOCK_XOR:
+			out.Put(" color0=");
+			out.Dec(d[0] & 0x0F);
+			out.Put(" color1=");
+			out.Dec(d[1] & 0x0F);
+			out.Put(" row=");
+			out.Dec(d[2] & 0x1F);
+			out.Put(" col=");
+			out.Dec(d[3] & 0x3F);
+			out.Put(" pixels=");
+			for (int i = 4; i < 16; i++)
+				out.Hex(d[i] & 0x3F, 2);
+			break;
+		case SCROLL_PRESET:
+		case SCROLL_COPY:
+			out.Put(" color=");
+			out.Dec(d[0] & 0x0F);
+			out.Put(" h=");
+			out.Dec((d[1] & 0x30) >> 4);
+			out.Put('/');
+			out.Dec(d[1] & 0x07);
+			out.Put(" v=");
+			out.Dec((d[2] & 0x30) >> 4);
+			out.Put('/');
+			out.Dec(d[2] & 0x0F);
+			break;
+		case LOAD_COLOR_TABLE_LO:
+		case LOAD_COLOR_TABLE_HI:
+			out.Put(" colors");
+			for (int i = 0; i < 8; i++)
+			{
+				out.Put(i ? ',' : '=');
+				out.Hex(((d[i*2] & 0x3F) << 6) | (d[(i*2)+1] & 0x3F), 3);
+			}
+			break;
+		default:
+			out.Put(" instruction=");
+			out.Dec(instruction);
+	}
+	out.Put('\n');
+}
+
+static bool DumpFile(Output &out, const char *filename, const Filter &f, Stats &st)
+{
+	CDGReader *rdr = CDGReader::GetMappedReader(filename, f.interleaved);
+	if ((rdr == NULL) || !rdr->Start())
+	{
+		delete rdr;
+		return false;
+	}
+
+	const SubCode *s;
+	unsigned long packet = 0;
+	while ((s = rdr->ReadNext()) != NULL)
+	{
+		bool graphics = ((s->command & 0x3F) == 9);
+		int instruction = s->instruction & 0x3F;
+		if (graphics)
+		{
+			st.instructions[instruction]++;
+			if (((instruction == SCROLL_PRESET) || (instruction == SCROLL_COPY)) &&
+				((s->data[1] & 0x07) || (s->data[2] & 0x0F)))
+				st.scroll_offsets++;
+		}
+		else
+			st.empty++;
+
+		if (f.list && (packet >= f.from) && (packet < f.to) &&
+			(graphics ? f.instructions[instruction] : f.empty))
+			Disassemble(out, s, packet, f);
+		packet++;
+	}
+	rdr->GetParityStats(st.corrected, st.dropped);
+	st.files++;
+	st.packets += packet;
+	st.bytes += (unsigned long long)packet * sizeof(SubCode);
+	delete rdr;
+	return true;
+}
+
+static void PrintStats(Output &out, const char *title, const Stats &st)
+{
+	unsigned long total = st.packets ? st.packets : 1;
+	unsigned long seconds = st.packets / CDG_PACKETS_PER_SECOND;
+
+	out.Flush();
+	printf("%s: %lu file(s), %lu packets, %lu:%02lu:%02lu\n", title, st.files, st.packets,
+		seconds / 3600, (seconds / 60) % 60, seconds % 60);
+	printf("\t%-22s %10lu %6.2f%%\n", "empty", st.empty, 100.0 * st.empty / total);
+	for (int i = 0; i < MAX_INSTRUCTIONS; i++)
+	{
+		if (st.instructions[i] == 0)
+			continue;
+		const char *name = CDGInstructionName(i);
+		char undefined[32];
+		if (!strcmp(name, "Undefined"))
+		{
+			snprintf(undefined, sizeof(undefined), "Undefined (%d)", i);
+			name = undefined;
+		}
+		printf("\t%-22s %10lu %6.2f%%\n", name, st.instructions[i], 100.0 * st.instructions[i] / total);
+	}
+	printf("\t%-22s %10lu\n", "palette loads", st.instructions[LOAD_COLOR_TABLE_LO] + st.instructions[LOAD_COLOR_TABLE_HI]);
+	printf("\t%-22s %10lu\n", "scrolls", st.instructions[SCROLL_PRESET] + st.instructions[SCROLL_COPY]);
+	printf("\t%-22s %10lu\n", "scrolls with offset", st.scroll_offsets);
+	printf("\t%-22s %10lu\n", "parity corrected", st.corrected);
+	printf("\t%-22s %10lu\n", "parity dropped", st.dropped);
+	fflush(stdout);
+}
+
+static bool ParseInstructions(char *list, Filter &f)
+{
+	memset(f.instructions, 0, sizeof(f.instructions));
+	for (char *tok = strtok(list, ","); tok; tok = strtok(NULL, ","))
+	{
+		char *end;
+		long n = strtol(tok, &end, 10);
+		if ((*end == '\0') && (n >= 0) && (n < MAX_INSTRUCTIONS))
+		{
+			f.instructions[n] = true;
+			continue;
+		}
+		int i;
+		for (i = 0; i < MAX_INSTRUCTIONS; i++)
+			if (!strcasecmp(tok, CDGInstructionName(i)) && strcasecmp(tok, "Undefined"))
+				break;
+		if (i == MAX_INSTRUCTIONS)
+		{
+			std::cerr << "Unknown instruction " << tok << "\n";
+			return false;
+		}
+		f.instructions[i] = true;
+	}
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	static Output out;
+	Filter f;
+	bool stats = false;
+	int opt;
+
+	for (int i = 0; i < MAX_INSTRUCTIONS; i++)
+		f.instructions[i] = true;
+	f.from = 0;
+	f.to = ~0UL;
+	f.empty = false;
+	f.raw = false;
+	f.list = true;
+	f.interleaved = false;
+
+	while ((opt = getopt(argc, argv, "sSxeri:t:")) != -1)
+	{
+		switch (opt)
+		{
+			case 's':
+				stats = true;
+				break;
+			case 'S':
+				stats = true;
+				f.list = false;
+				break;
+			case 'x':
+				f.raw = true;
+				break;
+			case 'e':
+				f.empty = true;
+				break;
+			case 'r':
+				f.interleaved = true;
+				break;
+			case 'i':
+				if (!ParseInstructions(optarg, f))
+					return -1;
+				break;
+			case 't':
+			{
+				double from = 0, to = -1;
+				if (sscanf(optarg, "%lf:%lf", &from, &to) < 1)
+				{
+					std::cerr << "Bad time range " << optarg << "\n";
+					return -1;
+				}
+				f.from = from * CDG_PACKETS_PER_SECOND;
+				if (to >= 0)
+					f.to = to * CDG_PACKETS_PER_SECOND;
+				break;
+			}
+			default:
+				argc = 0;
+		}
+	}
+	if (optind >= argc)
+	{
+		std::cerr << "Usage: " << (argc ? argv[0] : "dumpcdg") << " [-s|-S] [-x] [-e] [-r] [-i instr,...] [-t from:to] file.cdg...\n";
+		return -1;
+	}
+
+	struct timespec begin, end;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	Stats total;
+	memset(&total, 0, sizeof(total));
+	for (int i = optind; i < argc; i++)
+	{
+		Stats st;
+		memset(&st, 0, sizeof(st));
+		if ((argc - optind > 1) && f.list)
+		{
+			out.Reserve(strlen(argv[i]) + 4);
+			out.Put("== ");
+			out.Put(argv[i]);
+			out.Put('\n');
+		}
+		if (!DumpFile(out, argv[i], f, st))
+			continue;
+		if (stats)
+			PrintStats(out, argv[i], st);
+		total.Add(st);
+	}
+	out.Flush();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (stats && (argc - optind > 1))
+		PrintStats(out, "total", total);
+	if (stats)
+	{
+		double elapsed = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+		fprintf(stderr, "%.1f MB in %.3fs (%.0f MB/s)\n", total.bytes / 1e6, elapsed,
+			elapsed > 0 ? total.bytes / 1e6 / elapsed : 0.0);
+	}
+	return 0;
+}